@@ -0,0 +1,412 @@
+#include "AsyncLogger.hpp"
+
+#include "../../CBEngine/EngineCode/TimeUtil.hpp"
+
+LogLevel			AsyncLogger::s_minimumLevel = LOG_LEVEL_INFO;
+volatile LONG		AsyncLogger::s_isRunning = 0;
+HANDLE				AsyncLogger::s_flushThread = nullptr;
+FILE*				AsyncLogger::s_binaryLogFile = nullptr;
+int64_t				AsyncLogger::s_ticksPerSecond = 1;
+int64_t				AsyncLogger::s_startTicks = 0;
+LogRing*			AsyncLogger::s_rings[ LOG_MAX_THREADS ];
+volatile LONG		AsyncLogger::s_numRings = 0;
+
+namespace {
+
+	__declspec( thread ) LogRing* t_logRing = nullptr;
+
+	void appendAddress( uint64_t packedAddress, std::string& out_formattedLine ) {
+
+		// Address bytes are in network order, lowest byte is the first octet
+		unsigned int address = static_cast<unsigned int>( packedAddress >> 16 );
+		unsigned int port = static_cast<unsigned int>( packedAddress & 0xffff );
+
+		char buffer[32];
+		sprintf_s( buffer, sizeof( buffer ), "%u.%u.%u.%u:%u", address & 0xff, ( address >> 8 ) & 0xff, ( address >> 16 ) & 0xff, ( address >> 24 ) & 0xff, port );
+		out_formattedLine += buffer;
+	}
+
+
+	const char* getLevelName( unsigned int level ) {
+
+		switch ( level ) {
+			case LOG_LEVEL_DEBUG:	return "DEBUG";
+			case LOG_LEVEL_INFO:	return "INFO ";
+			case LOG_LEVEL_WARNING:	return "WARN ";
+			case LOG_LEVEL_ERROR:	return "ERROR";
+			default:				return "?????";
+		}
+	}
+}
+
+
+void AsyncLogger::initialize( const std::string& binaryLogFilePath ) {
+
+	LARGE_INTEGER frequency;
+	LARGE_INTEGER startCounter;
+	QueryPerformanceFrequency( &frequency );
+	QueryPerformanceCounter( &startCounter );
+
+	s_ticksPerSecond = frequency.QuadPart;
+	s_startTicks = startCounter.QuadPart;
+
+	if ( !binaryLogFilePath.empty() ) {
+
+		if ( fopen_s( &s_binaryLogFile, binaryLogFilePath.c_str(), "wb" ) != 0 ) {
+
+			printf( "Unable to open binary log file %s, logging to console only\n", binaryLogFilePath.c_str() );
+			s_binaryLogFile = nullptr;
+
+		} else {
+
+			LogFileHeader header;
+			memcpy( header.m_magic, LOG_FILE_MAGIC, sizeof( header.m_magic ) );
+			header.m_messageTableVersion = LOG_MESSAGE_TABLE_VERSION;
+			header.m_ticksPerSecond = s_ticksPerSecond;
+			header.m_startTicks = s_startTicks;
+			fwrite( &header, sizeof( header ), 1, s_binaryLogFile );
+		}
+	}
+
+	s_isRunning = 1;
+	s_flushThread = CreateThread( nullptr, 0, &AsyncLogger::flushThreadMain, nullptr, 0, nullptr );
+
+	if ( s_flushThread == nullptr ) {
+
+		printf( "Unable to start log flush thread, logging synchronously\n" );
+		s_isRunning = 0;
+	}
+}
+
+
+void AsyncLogger::shutdown() {
+
+	if ( s_flushThread != nullptr ) {
+
+		InterlockedExchange( &s_isRunning, 0 );
+		WaitForSingleObject( s_flushThread, INFINITE );
+		CloseHandle( s_flushThread );
+		s_flushThread = nullptr;
+	}
+
+	// Anything logged after the flush thread's final drain
+	drainRings();
+
+	if ( s_binaryLogFile != nullptr ) {
+
+		fclose( s_binaryLogFile );
+		s_binaryLogFile = nullptr;
+	}
+}
+
+
+void AsyncLogger::log( LogLevel level, LogMessageID messageID, LogArg arg0, LogArg arg1, LogArg arg2, LogArg arg3 ) {
+
+	LogRing* ring = ( s_isRunning != 0 ) ? getRingForCurrentThread() : nullptr;
+
+	if ( ring == nullptr ) {
+
+		// No flush thread to hand off to, format in place
+		LogRecord record;
+		fillRecord( record, GetCurrentThreadId(), level, messageID, arg0, arg1, arg2, arg3 );
+		writeRecord( record );
+		return;
+	}
+
+	LONG writeIndex = ring->m_writeIndex;
+	if ( writeIndex - ring->m_readIndex >= LOG_RING_CAPACITY ) {
+
+		// Never block the caller, the flush thread reports the loss
+		InterlockedIncrement( &ring->m_numDroppedRecords );
+		return;
+	}
+
+	fillRecord( ring->m_records[ writeIndex & ( LOG_RING_CAPACITY - 1 ) ], ring->m_threadID, level, messageID, arg0, arg1, arg2, arg3 );
+
+	// Publish only after the record is fully written
+	ring->m_writeIndex = writeIndex + 1;
+}
+
+
+void AsyncLogger::fillRecord( LogRecord& out_record, uint32_t threadID, LogLevel level, LogMessageID messageID, LogArg arg0, LogArg arg1, LogArg arg2, LogArg arg3 ) {
+
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter( &counter );
+
+	out_record.m_timestampTicks = counter.QuadPart;
+	out_record.m_threadID = threadID;
+	out_record.m_messageID = static_cast<uint16_t>( messageID );
+	out_record.m_level = static_cast<uint8_t>( level );
+	out_record.m_padding = 0;
+	out_record.m_args[0] = arg0.m_bits;
+	out_record.m_args[1] = arg1.m_bits;
+	out_record.m_args[2] = arg2.m_bits;
+	out_record.m_args[3] = arg3.m_bits;
+}
+
+
+LogRing* AsyncLogger::getRingForCurrentThread() {
+
+	if ( t_logRing != nullptr ) {
+
+		return t_logRing;
+	}
+
+	// Take over a ring an exited thread gave back before growing the table
+	LONG numRings = s_numRings;
+	for ( int i = 0; i < numRings && i < LOG_MAX_THREADS; ++i ) {
+
+		LogRing* ring = s_rings[i];
+		if ( ring != nullptr && InterlockedCompareExchange( &ring->m_isOwned, 1, 0 ) == 0 ) {
+
+			// Records already queued keep the previous owner's ID, they carry their own copy
+			ring->m_threadID = GetCurrentThreadId();
+			t_logRing = ring;
+			return ring;
+		}
+	}
+
+	LONG ringIndex = InterlockedIncrement( &s_numRings ) - 1;
+	if ( ringIndex >= LOG_MAX_THREADS ) {
+
+		InterlockedDecrement( &s_numRings );
+		return nullptr;
+	}
+
+	LogRing* ring = new LogRing;
+	ring->m_writeIndex = 0;
+	ring->m_readIndex = 0;
+	ring->m_numDroppedRecords = 0;
+	ring->m_isOwned = 1;
+	ring->m_threadID = GetCurrentThreadId();
+
+	// Flush thread checks for null, so the slot becomes visible only once the ring is ready
+	InterlockedExchangePointer( reinterpret_cast<void* volatile*>( &s_rings[ ringIndex ] ), ring );
+	t_logRing = ring;
+
+	return ring;
+}
+
+
+void AsyncLogger::releaseThreadRing() {
+
+	if ( t_logRing == nullptr ) {
+
+		return;
+	}
+
+	// Full barrier, so the next owner sees every write index this thread published
+	InterlockedExchange( &t_logRing->m_isOwned, 0 );
+	t_logRing = nullptr;
+}
+
+
+DWORD WINAPI AsyncLogger::flushThreadMain( void* unused ) {
+
+	while ( s_isRunning != 0 ) {
+
+		if ( !drainRings() ) {
+
+			Sleep( LOG_FLUSH_INTERVAL_MILLISECONDS );
+		}
+	}
+
+	drainRings();
+	return 0;
+}
+
+
+bool AsyncLogger::drainRings() {
+
+	bool drainedAnything = false;
+	LONG numRings = s_numRings;
+
+	for ( int i = 0; i < numRings && i < LOG_MAX_THREADS; ++i ) {
+
+		LogRing* ring = s_rings[i];
+		if ( ring == nullptr ) {
+
+			continue;
+		}
+
+		LONG readIndex = ring->m_readIndex;
+		LONG writeIndex = ring->m_writeIndex;
+
+		while ( readIndex != writeIndex ) {
+
+			writeRecord( ring->m_records[ readIndex & ( LOG_RING_CAPACITY - 1 ) ] );
+			++readIndex;
+
+			// Hand the slot back to the producer
+			ring->m_readIndex = readIndex;
+			drainedAnything = true;
+		}
+
+		LONG numDropped = InterlockedExchange( &ring->m_numDroppedRecords, 0 );
+		if ( numDropped > 0 ) {
+
+			LogRecord overflowRecord;
+			fillRecord( overflowRecord, GetCurrentThreadId(), LOG_LEVEL_WARNING, LOG_MSG_RING_OVERFLOW, ring->m_threadID, static_cast<unsigned int>( numDropped ) );
+			writeRecord( overflowRecord );
+		}
+	}
+
+	if ( drainedAnything ) {
+
+		fflush( stdout );
+		if ( s_binaryLogFile != nullptr ) {
+
+			fflush( s_binaryLogFile );
+		}
+	}
+
+	return drainedAnything;
+}
+
+
+void AsyncLogger::writeRecord( const LogRecord& record ) {
+
+	std::string formattedLine;
+	formatRecord( record, s_ticksPerSecond, s_startTicks, formattedLine );
+	fputs( formattedLine.c_str(), stdout );
+
+	if ( s_binaryLogFile != nullptr ) {
+
+		fwrite( &record, sizeof( record ), 1, s_binaryLogFile );
+	}
+}
+
+
+void AsyncLogger::formatRecord( const LogRecord& record, int64_t ticksPerSecond, int64_t startTicks, std::string& out_formattedLine ) {
+
+	char buffer[64];
+	double secondsSinceStart = static_cast<double>( record.m_timestampTicks - startTicks ) / static_cast<double>( ticksPerSecond );
+	sprintf_s( buffer, sizeof( buffer ), "[%10.4f] %s ", secondsSinceStart, getLevelName( record.m_level ) );
+	out_formattedLine += buffer;
+
+	const char* format = getLogMessageFormat( record.m_messageID );
+	int argIndex = 0;
+
+	for ( const char* current = format; *current != '\0'; ++current ) {
+
+		if ( *current != '%' || current[1] == '\0' ) {
+
+			out_formattedLine += *current;
+			continue;
+		}
+
+		++current;
+		if ( *current == '%' ) {
+
+			out_formattedLine += '%';
+			continue;
+		}
+
+		uint64_t argBits = ( argIndex < LOG_RECORD_MAX_ARGS ) ? record.m_args[ argIndex ] : 0;
+		++argIndex;
+
+		switch ( *current ) {
+			case 'd':
+				sprintf_s( buffer, sizeof( buffer ), "%lld", static_cast<long long>( argBits ) );
+				out_formattedLine += buffer;
+				break;
+			case 'u':
+				sprintf_s( buffer, sizeof( buffer ), "%llu", static_cast<unsigned long long>( argBits ) );
+				out_formattedLine += buffer;
+				break;
+			case 'x':
+				sprintf_s( buffer, sizeof( buffer ), "%llx", static_cast<unsigned long long>( argBits ) );
+				out_formattedLine += buffer;
+				break;
+			case 'f': {
+				double value = 0.0;
+				memcpy( &value, &argBits, sizeof( value ) );
+				sprintf_s( buffer, sizeof( buffer ), "%f", value );
+				out_formattedLine += buffer;
+				break;
+			}
+			case 'A':
+				appendAddress( argBits, out_formattedLine );
+				break;
+			default:
+				out_formattedLine += '%';
+				out_formattedLine += *current;
+				break;
+		}
+	}
+
+	out_formattedLine += '\n';
+}
+
+
+bool AsyncLogger::decodeBinaryLogFile( const std::string& binaryLogFilePath, FILE* outputFile ) {
+
+	FILE* binaryLogFile = nullptr;
+	if ( fopen_s( &binaryLogFile, binaryLogFilePath.c_str(), "rb" ) != 0 ) {
+
+		printf( "Unable to open binary log file %s\n", binaryLogFilePath.c_str() );
+		return false;
+	}
+
+	LogFileHeader header;
+	if ( fread( &header, sizeof( header ), 1, binaryLogFile ) != 1 || memcmp( header.m_magic, LOG_FILE_MAGIC, sizeof( header.m_magic ) ) != 0 ) {
+
+		printf( "%s is not a binary log file\n", binaryLogFilePath.c_str() );
+		fclose( binaryLogFile );
+		return false;
+	}
+
+	if ( header.m_messageTableVersion != LOG_MESSAGE_TABLE_VERSION ) {
+
+		printf( "Warning: log was written with message table version %u, decoder has version %u\n", header.m_messageTableVersion, LOG_MESSAGE_TABLE_VERSION );
+	}
+
+	if ( header.m_ticksPerSecond <= 0 ) {
+
+		header.m_ticksPerSecond = 1;
+	}
+
+	LogRecord record;
+	std::string formattedLine;
+	while ( fread( &record, sizeof( record ), 1, binaryLogFile ) == 1 ) {
+
+		formattedLine.clear();
+		formatRecord( record, header.m_ticksPerSecond, header.m_startTicks, formattedLine );
+		fputs( formattedLine.c_str(), outputFile );
+	}
+
+	fclose( binaryLogFile );
+	return true;
+}
+
+
+bool LogRateLimiter::shouldLog() {
+
+	// Another thread is already in here, count this one as suppressed rather than wait
+	if ( InterlockedCompareExchange( &m_isBusy, 1, 0 ) != 0 ) {
+
+		InterlockedIncrement( &m_numSuppressed );
+		return false;
+	}
+
+	bool allowed = m_bucket.tryConsume( RateLimitConfig( LOG_RATE_LIMITED_PER_SECOND, LOG_RATE_LIMITED_BURST ), cbutil::getCurrentTimeSeconds() );
+
+	LONG numSuppressed = 0;
+	if ( allowed ) {
+
+		numSuppressed = InterlockedExchange( &m_numSuppressed, 0 );
+
+	} else {
+
+		InterlockedIncrement( &m_numSuppressed );
+	}
+
+	InterlockedExchange( &m_isBusy, 0 );
+
+	if ( numSuppressed > 0 ) {
+
+		AsyncLogger::log( LOG_LEVEL_WARNING, LOG_MSG_SUPPRESSED, static_cast<unsigned int>( numSuppressed ) );
+	}
+
+	return allowed;
+}
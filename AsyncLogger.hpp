@@ -0,0 +1,156 @@
+#ifndef included_AsyncLogger
+#define included_AsyncLogger
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "Ws2_32.lib")
+
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include "LogMessages.hpp"
+#include "RateLimiter.hpp"
+#include "WorkerPool.hpp"
+
+typedef enum {
+
+	LOG_LEVEL_DEBUG,
+	LOG_LEVEL_INFO,
+	LOG_LEVEL_WARNING,
+	LOG_LEVEL_ERROR,
+
+} LogLevel;
+
+const int		LOG_RECORD_MAX_ARGS = 4;
+const int		LOG_RING_CAPACITY = 4096; // Records per thread, must be a power of two
+const int		LOG_MAX_THREADS = MAX_WORKER_THREADS + 2; // Every worker plus the socket and writer threads
+const DWORD		LOG_FLUSH_INTERVAL_MILLISECONDS = 5;
+const char		LOG_FILE_MAGIC[4] = { 'F', 'B', 'L', 'G' };
+const float		LOG_RATE_LIMITED_PER_SECOND = 2.0f;
+const float		LOG_RATE_LIMITED_BURST = 5.0f;
+
+// One argument slot. Integers are stored as is, doubles by bit pattern and
+// addresses packed as ( network order IPv4 << 16 ) | host order port.
+struct LogArg {
+public:
+	LogArg() : m_bits( 0 ) {}
+	LogArg( int value ) : m_bits( static_cast<uint64_t>( static_cast<int64_t>( value ) ) ) {}
+	LogArg( unsigned int value ) : m_bits( value ) {}
+	LogArg( double value ) { memcpy( &m_bits, &value, sizeof( m_bits ) ); }
+	LogArg( float value ) { double widened = value; memcpy( &m_bits, &widened, sizeof( m_bits ) ); }
+	LogArg( const sockaddr_in& address ) : m_bits( ( static_cast<uint64_t>( address.sin_addr.s_addr ) << 16 ) | ntohs( address.sin_port ) ) {}
+
+	uint64_t			m_bits;
+};
+
+// Fixed 48 byte record, written to the ring by the logging thread and to the
+// binary log file verbatim by the flush thread
+struct LogRecord {
+	int64_t				m_timestampTicks;
+	uint32_t			m_threadID;
+	uint16_t			m_messageID;
+	uint8_t				m_level;
+	uint8_t				m_padding;
+	uint64_t			m_args[ LOG_RECORD_MAX_ARGS ];
+};
+
+struct LogFileHeader {
+	char				m_magic[4];
+	uint32_t			m_messageTableVersion;
+	int64_t				m_ticksPerSecond;
+	int64_t				m_startTicks;
+};
+
+// Single producer ( owning thread ) single consumer ( flush thread ) ring.
+// MSVC volatile gives acquire loads and release stores, which is all x86 needs.
+// The indices sit on separate cache lines so the two threads don't fight over one.
+struct LogRing {
+	LogRecord			m_records[ LOG_RING_CAPACITY ];
+	volatile LONG		m_writeIndex;
+	volatile LONG		m_numDroppedRecords;
+	volatile LONG		m_isOwned; // Cleared when the owning thread exits so another thread can reuse the ring
+	uint32_t			m_threadID;
+	char				m_cacheLinePadding[ 64 - 4 * sizeof( LONG ) ];
+	volatile LONG		m_readIndex;
+};
+
+class AsyncLogger {
+public:
+
+	static void initialize( const std::string& binaryLogFilePath );
+	static void shutdown();
+
+	static void setMinimumLevel( LogLevel level ) { s_minimumLevel = level; }
+	static bool isLevelEnabled( LogLevel level ) { return level >= s_minimumLevel; }
+
+	// Call from a thread that logged before it exits. Its ring stays registered and is
+	// drained as usual, then handed to the next thread that logs.
+	static void releaseThreadRing();
+
+	static void log( LogLevel level, LogMessageID messageID, LogArg arg0 = LogArg(), LogArg arg1 = LogArg(), LogArg arg2 = LogArg(), LogArg arg3 = LogArg() );
+
+	static void formatRecord( const LogRecord& record, int64_t ticksPerSecond, int64_t startTicks, std::string& out_formattedLine );
+	static bool decodeBinaryLogFile( const std::string& binaryLogFilePath, FILE* outputFile );
+
+protected:
+
+	static LogLevel										s_minimumLevel;
+	static volatile LONG								s_isRunning;
+	static HANDLE										s_flushThread;
+	static FILE*										s_binaryLogFile;
+	static int64_t										s_ticksPerSecond;
+	static int64_t										s_startTicks;
+
+	static LogRing*										s_rings[ LOG_MAX_THREADS ];
+	static volatile LONG								s_numRings;
+
+private:
+
+	static LogRing* getRingForCurrentThread();
+	static DWORD WINAPI flushThreadMain( void* unused );
+	static void fillRecord( LogRecord& out_record, uint32_t threadID, LogLevel level, LogMessageID messageID, LogArg arg0 = LogArg(), LogArg arg1 = LogArg(), LogArg arg2 = LogArg(), LogArg arg3 = LogArg() );
+	static bool drainRings();
+	static void writeRecord( const LogRecord& record );
+};
+
+// Per call site limiter so an error repeated every tick can't flood the log.
+// POD so each call site's static is constant initialised, which keeps it
+// safe to hit from several worker threads on VS2010.
+struct LogRateLimiter {
+public:
+	bool shouldLog();
+
+	volatile LONG										m_isBusy;
+	volatile LONG										m_numSuppressed;
+	TokenBucket											m_bucket;
+};
+
+#define LOG_AT_LEVEL( level, ... ) \
+	do { \
+		if ( AsyncLogger::isLevelEnabled( level ) ) { \
+			AsyncLogger::log( level, __VA_ARGS__ ); \
+		} \
+	} while ( 0 )
+
+// Usage: LOG_INFO( LOG_MSG_SOMETHING, arg0, arg1 )
+#define LOG_DEBUG( ... )		LOG_AT_LEVEL( LOG_LEVEL_DEBUG, __VA_ARGS__ )
+#define LOG_INFO( ... )			LOG_AT_LEVEL( LOG_LEVEL_INFO, __VA_ARGS__ )
+#define LOG_WARNING( ... )		LOG_AT_LEVEL( LOG_LEVEL_WARNING, __VA_ARGS__ )
+#define LOG_ERROR( ... )		LOG_AT_LEVEL( LOG_LEVEL_ERROR, __VA_ARGS__ )
+
+#define LOG_ERROR_RATE_LIMITED( ... ) \
+	do { \
+		static LogRateLimiter s_callSiteLimiter = { 0, 0, { -1.0f, 0 } }; \
+		if ( s_callSiteLimiter.shouldLog() ) { \
+			LOG_ERROR( __VA_ARGS__ ); \
+		} \
+	} while ( 0 )
+
+#endif
@@ -1,50 +1,23 @@
 #include "ConnectedUDPClient.hpp"
 
-int ConnectedUDPClient::s_numberOfClients = 0;
+volatile LONG ConnectedUDPClient::s_numberOfClients = 0;
 
 ConnectedUDPClient::~ConnectedUDPClient() {
 
-	--s_numberOfClients;
+	InterlockedDecrement( &s_numberOfClients );
 }
 
 
-ConnectedUDPClient::ConnectedUDPClient() {
+ConnectedUDPClient::ConnectedUDPClient( int playerID ) {
 	
 	m_timeStampSecondsForLastPacketReceived = 0.0;
-	++s_numberOfClients;
-	m_playerID = s_numberOfClients;
+	m_numPacketsDroppedByRateLimit = 0;
+	m_rateLimitBucket.reset();
+	InterlockedIncrement( &s_numberOfClients );
+	m_playerID = playerID;
 
-	assignColorForPlayer();
-}
-
-
-// Temp hacky way to assign colors for players
-void ConnectedUDPClient::assignColorForPlayer() {
-
-	if ( s_numberOfClients == 1 ) {
-
-		m_red = 250;
-		m_green = 200;
-		m_blue = 200;
-
-	} else if ( s_numberOfClients == 2 ) {
+	m_worldStateIndex = INVALID_WORLD_STATE_INDEX;
 
-		m_red = 220;
-		m_green = 50;
-		m_blue = 50;
-
-	} else if ( s_numberOfClients == 3 ) {
-
-		m_red = 50;
-		m_green = 250;
-		m_blue = 50;
-
-	} else if ( s_numberOfClients == 4 ) {
-
-		m_red = 50;
-		m_green = 50;
-		m_blue = 250;
-	}
+	m_isRelayed = false;
+	ZeroMemory( &m_relayAddress, sizeof( m_relayAddress ) );
 }
-
-
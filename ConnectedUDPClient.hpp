@@ -13,37 +13,34 @@
 #include <windows.h>
 
 
-#include "../../CBEngine/EngineCode/Vector2.hpp"
-
 #include "UDPServer.hpp"
+#include "RateLimiter.hpp"
+#include "WorldState.hpp"
 
 class ConnectedUDPClient {
 public:
-	static int											s_numberOfClients;
+	static volatile LONG								s_numberOfClients; // Across every room
 
 	~ConnectedUDPClient();
-	ConnectedUDPClient();
+	explicit ConnectedUDPClient( int playerID );
 
 	double												m_timeStampSecondsForLastPacketReceived;
 
-	cbengine::Vector2									m_position;
-	char												m_red;
-	char												m_green;
-	char												m_blue;
+	// Position and colour live in the room's WorldState
+	int													m_worldStateIndex;
 
 	sockaddr_in											m_clientAddress;
 	std::string											m_userID;
 	int													m_playerID;
 
-	std::map<int,PlayerDataPacket>						m_reliablePacketsSentButNotAcked;
-
-protected:
-
-	void assignColorForPlayer();
-
-private:
+	// Set when the client reaches the room through a relay, replies are wrapped and sent to the relay
+	bool												m_isRelayed;
+	sockaddr_in											m_relayAddress;
 
+	std::map<int,PlayerDataPacket>						m_reliablePacketsSentButNotAcked;
 
+	TokenBucket											m_rateLimitBucket;
+	unsigned int										m_numPacketsDroppedByRateLimit;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,912 @@
+#include "GameRoom.hpp"
+
+#include "ConnectedUDPClient.hpp"
+#include "AsyncLogger.hpp"
+
+#include "../../CBEngine/EngineCode/TimeUtil.hpp"
+#include "../../CBEngine/EngineCode/MathUtil.hpp"
+
+GameRoom::~GameRoom() {
+
+	std::map<AddressKey,ConnectedUDPClient*>::iterator itClient;
+	for ( itClient = m_clients.begin(); itClient != m_clients.end(); ++itClient ) {
+
+		delete itClient->second;
+	}
+
+	m_clients.clear();
+	DeleteCriticalSection( &m_inboxLock );
+}
+
+
+GameRoom::GameRoom( int sessionID, SOCKET sendSocket, const RateLimitConfig& perClientRateLimit, float packetLossThreshold, PersistedRoom* persistedRoom ) {
+
+	m_sessionID = sessionID;
+	m_sendSocket = sendSocket;
+	m_perClientRateLimit = perClientRateLimit;
+	m_relayedJoinRateLimit = RateLimitConfig( RELAYED_JOINS_PER_SECOND, RELAYED_JOIN_BURST_SIZE );
+	m_thresholdForPacketLossSimulation = packetLossThreshold;
+	m_persistedRoom = persistedRoom;
+	m_usedPlayerIDs = 0;
+
+	respawnFlag();
+
+	m_lastTickTimeSeconds = cbutil::getCurrentTimeSeconds();
+	m_lastOccupiedTimeSeconds = m_lastTickTimeSeconds;
+	m_durationSinceLastUserConnectedUpdate = 0.0;
+	m_durationSinceLastPacketUpdate = 0.0;
+
+	InitializeCriticalSection( &m_inboxLock );
+
+	m_isTickScheduled = 0;
+	m_numClients = 0;
+	m_numPacketsDroppedByRateLimit = 0;
+	m_numUnsolicitedPacketsDropped = 0;
+	m_numQueueOverflowDrops = 0;
+}
+
+
+bool GameRoom::queueIncomingPacket( const sockaddr_in& sourceAddress, const PlayerDataPacket& packet, bool passedHandshake, double receiveTimeSeconds ) {
+
+	QueuedPacket queuedPacket;
+	queuedPacket.m_sourceAddress = sourceAddress;
+	queuedPacket.m_packet = packet;
+	queuedPacket.m_passedHandshake = passedHandshake;
+	queuedPacket.m_isRelayed = false;
+	queuedPacket.m_receiveTimeSeconds = receiveTimeSeconds;
+
+	return pushToInbox( queuedPacket );
+}
+
+
+bool GameRoom::queueRelayedPacket( const sockaddr_in& clientAddress, const PlayerDataPacket& packet, const sockaddr_in& relayAddress, double receiveTimeSeconds ) {
+
+	QueuedPacket queuedPacket;
+	queuedPacket.m_sourceAddress = clientAddress;
+	queuedPacket.m_packet = packet;
+	queuedPacket.m_passedHandshake = false;
+	queuedPacket.m_isRelayed = true;
+	queuedPacket.m_relayAddress = relayAddress;
+	queuedPacket.m_receiveTimeSeconds = receiveTimeSeconds;
+
+	return pushToInbox( queuedPacket );
+}
+
+
+bool GameRoom::pushToInbox( const QueuedPacket& queuedPacket ) {
+
+	bool queued = false;
+
+	EnterCriticalSection( &m_inboxLock );
+	if ( static_cast<int>( m_inbox.size() ) < MAX_QUEUED_PACKETS_PER_ROOM ) {
+
+		m_inbox.push_back( queuedPacket );
+		queued = true;
+	}
+	LeaveCriticalSection( &m_inboxLock );
+
+	if ( !queued ) {
+
+		InterlockedIncrement( &m_numQueueOverflowDrops );
+	}
+
+	return queued;
+}
+
+
+void GameRoom::collectDepartedClients( std::vector<AddressKey>& out_departedClients ) {
+
+	EnterCriticalSection( &m_inboxLock );
+	out_departedClients.insert( out_departedClients.end(), m_departedClients.begin(), m_departedClients.end() );
+	m_departedClients.clear();
+	LeaveCriticalSection( &m_inboxLock );
+}
+
+
+bool GameRoom::tryMarkTickScheduled() {
+
+	// A room still running last tick is skipped rather than queued twice
+	return InterlockedCompareExchange( &m_isTickScheduled, 1, 0 ) == 0;
+}
+
+
+void GameRoom::cancelScheduledTick() {
+
+	// A stopped pool drops its queued tasks, so a room marked scheduled would never tick again
+	InterlockedExchange( &m_isTickScheduled, 0 );
+}
+
+
+bool GameRoom::isIdle( double currentTimeSeconds ) {
+
+	// Holding the mark means no tick is queued or running, so tick state is safe to read here
+	if ( !m_clients.empty() || !m_relaySubscribers.empty() ) {
+
+		return false;
+	}
+
+	EnterCriticalSection( &m_inboxLock );
+	bool hasPendingPackets = !m_inbox.empty() || !m_departedClients.empty();
+	LeaveCriticalSection( &m_inboxLock );
+
+	return !hasPendingPackets && currentTimeSeconds - m_lastOccupiedTimeSeconds > ROOM_IDLE_TIMEOUT_SECONDS;
+}
+
+
+void GameRoom::execute() {
+
+	double currentTimeSeconds = cbutil::getCurrentTimeSeconds();
+	double timeDifSeconds = currentTimeSeconds - m_lastTickTimeSeconds;
+	m_lastTickTimeSeconds = currentTimeSeconds;
+
+	m_durationSinceLastUserConnectedUpdate += timeDifSeconds;
+	m_durationSinceLastPacketUpdate += timeDifSeconds;
+
+	// Swap so the front thread is only ever blocked for the length of a pointer swap
+	m_packetsBeingProcessed.clear();
+	EnterCriticalSection( &m_inboxLock );
+	m_packetsBeingProcessed.swap( m_inbox );
+	LeaveCriticalSection( &m_inboxLock );
+
+	for ( int i = 0; i < static_cast<int>( m_packetsBeingProcessed.size() ); ++i ) {
+
+		processPacket( m_packetsBeingProcessed[i] );
+	}
+
+	checkForExpiredClients();
+	checkForExpiredRelaySubscribers();
+
+	if ( !m_clients.empty() || !m_relaySubscribers.empty() ) {
+
+		m_lastOccupiedTimeSeconds = currentTimeSeconds;
+	}
+
+	m_worldState.zeroStaleVelocities( currentTimeSeconds );
+
+	checkForPlayersAtFlag();
+	displayConnectedUsers();
+	sendPlayerDataToClients();
+	checkForExpiredReliablePacketsWithNoAcks();
+	persistState();
+
+	InterlockedExchange( &m_isTickScheduled, 0 );
+}
+
+
+void GameRoom::restoreFromPersistedRoom( std::vector<AddressKey>& out_restoredClients, std::vector<sockaddr_in>& out_restoredRelays ) {
+
+	if ( m_persistedRoom == nullptr ) {
+
+		return;
+	}
+
+	const PersistedRoom& persistedRoom = *m_persistedRoom;
+
+	// Odd means the writer died mid tick, start the room empty rather than trust half a table
+	if ( ( persistedRoom.m_writeSequence & 1 ) != 0 || persistedRoom.m_sessionID != m_sessionID ) {
+
+		return;
+	}
+
+	m_flagPosition.x = persistedRoom.m_flagXPosition;
+	m_flagPosition.y = persistedRoom.m_flagYPosition;
+
+	// Stored times are on the old process's clock, carry over only how long ago each packet was
+	double currentTimeSeconds = cbutil::getCurrentTimeSeconds();
+	int numClients = persistedRoom.m_numClients;
+	if ( numClients > MAX_PLAYERS_PER_ROOM ) {
+
+		numClients = MAX_PLAYERS_PER_ROOM;
+	}
+
+	for ( int i = 0; i < numClients; ++i ) {
+
+		const PersistedClient& persistedClient = persistedRoom.m_clients[i];
+		double secondsSinceLastPacket = persistedRoom.m_writeTimeSeconds - persistedClient.m_lastPacketTimeSeconds;
+		double lastPacketTimeSeconds = currentTimeSeconds - secondsSinceLastPacket;
+
+		if ( !tryClaimPlayerID( persistedClient.m_playerID ) ) {
+
+			continue;
+		}
+
+		int worldStateIndex = m_worldState.addPlayer( persistedClient.m_playerID, persistedClient.m_xPosition, persistedClient.m_yPosition, currentTimeSeconds );
+		if ( worldStateIndex == INVALID_WORLD_STATE_INDEX ) {
+
+			releasePlayerID( persistedClient.m_playerID );
+			break;
+		}
+
+		m_worldState.m_velocityX[ worldStateIndex ] = persistedClient.m_xVelocity;
+		m_worldState.m_velocityY[ worldStateIndex ] = persistedClient.m_yVelocity;
+		m_worldState.m_yawDegrees[ worldStateIndex ] = persistedClient.m_yawDegrees;
+		m_worldState.m_red[ worldStateIndex ] = persistedClient.m_red;
+		m_worldState.m_green[ worldStateIndex ] = persistedClient.m_green;
+		m_worldState.m_blue[ worldStateIndex ] = persistedClient.m_blue;
+
+		ConnectedUDPClient* client = new ConnectedUDPClient( persistedClient.m_playerID );
+		ZeroMemory( &client->m_clientAddress, sizeof( client->m_clientAddress ) );
+		client->m_clientAddress.sin_family = AF_INET;
+		client->m_clientAddress.sin_addr.s_addr = persistedClient.m_address;
+		client->m_clientAddress.sin_port = persistedClient.m_port;
+		UDPServer::convertIPAndPortToSingleString( inet_ntoa( client->m_clientAddress.sin_addr ), ntohs( persistedClient.m_port ), client->m_userID );
+		client->m_timeStampSecondsForLastPacketReceived = lastPacketTimeSeconds;
+		client->m_worldStateIndex = worldStateIndex;
+
+		if ( persistedClient.m_relayPort != 0 ) {
+
+			client->m_isRelayed = true;
+			client->m_relayAddress.sin_family = AF_INET;
+			client->m_relayAddress.sin_addr.s_addr = persistedClient.m_relayAddress;
+			client->m_relayAddress.sin_port = persistedClient.m_relayPort;
+
+		} else {
+
+			// Relayed clients never talk to the front, their relay does
+			out_restoredClients.push_back( makeAddressKey( client->m_clientAddress ) );
+		}
+
+		m_clients.insert( std::pair<AddressKey,ConnectedUDPClient*>( makeAddressKey( client->m_clientAddress ), client ) );
+		InterlockedIncrement( &m_numClients );
+	}
+
+	int numRelays = persistedRoom.m_numRelays;
+	if ( numRelays > MAX_RELAY_SUBSCRIBERS_PER_ROOM ) {
+
+		numRelays = MAX_RELAY_SUBSCRIBERS_PER_ROOM;
+	}
+
+	for ( int i = 0; i < numRelays; ++i ) {
+
+		const PersistedRelay& persistedRelay = persistedRoom.m_relays[i];
+
+		RelaySubscriber subscriber;
+		ZeroMemory( &subscriber.m_address, sizeof( subscriber.m_address ) );
+		subscriber.m_address.sin_family = AF_INET;
+		subscriber.m_address.sin_addr.s_addr = persistedRelay.m_address;
+		subscriber.m_address.sin_port = persistedRelay.m_port;
+		subscriber.m_timeStampSecondsForLastPacketReceived = currentTimeSeconds - ( persistedRoom.m_writeTimeSeconds - persistedRelay.m_lastPacketTimeSeconds );
+		subscriber.m_joinRateLimitBucket.reset();
+
+		m_relaySubscribers.insert( std::pair<AddressKey,RelaySubscriber>( makeAddressKey( subscriber.m_address ), subscriber ) );
+		out_restoredRelays.push_back( subscriber.m_address );
+	}
+
+	m_snapshotBuilder.invalidateBaseline();
+}
+
+
+void GameRoom::persistState() {
+
+	if ( m_persistedRoom == nullptr ) {
+
+		return;
+	}
+
+	PersistedRoom& persistedRoom = *m_persistedRoom;
+
+	// Odd while writing, interlocked so the marker lands before and after the table
+	InterlockedIncrement( &persistedRoom.m_writeSequence );
+
+	persistedRoom.m_sessionID = m_sessionID;
+	persistedRoom.m_flagXPosition = m_flagPosition.x;
+	persistedRoom.m_flagYPosition = m_flagPosition.y;
+	persistedRoom.m_writeTimeSeconds = cbutil::getCurrentTimeSeconds();
+
+	int numClients = 0;
+	std::map<AddressKey,ConnectedUDPClient*>::iterator itClient;
+	for ( itClient = m_clients.begin(); itClient != m_clients.end() && numClients < MAX_PLAYERS_PER_ROOM; ++itClient ) {
+
+		ConnectedUDPClient* client = itClient->second;
+		int index = client->m_worldStateIndex;
+		PersistedClient& persistedClient = persistedRoom.m_clients[ numClients ];
+
+		persistedClient.m_address = client->m_clientAddress.sin_addr.s_addr;
+		persistedClient.m_port = client->m_clientAddress.sin_port;
+		persistedClient.m_relayAddress = client->m_isRelayed ? client->m_relayAddress.sin_addr.s_addr : 0;
+		persistedClient.m_relayPort = client->m_isRelayed ? client->m_relayAddress.sin_port : 0;
+		persistedClient.m_playerID = client->m_playerID;
+		persistedClient.m_xPosition = m_worldState.m_positionX[ index ];
+		persistedClient.m_yPosition = m_worldState.m_positionY[ index ];
+		persistedClient.m_xVelocity = m_worldState.m_velocityX[ index ];
+		persistedClient.m_yVelocity = m_worldState.m_velocityY[ index ];
+		persistedClient.m_yawDegrees = m_worldState.m_yawDegrees[ index ];
+		persistedClient.m_red = m_worldState.m_red[ index ];
+		persistedClient.m_green = m_worldState.m_green[ index ];
+		persistedClient.m_blue = m_worldState.m_blue[ index ];
+		persistedClient.m_padding2 = 0;
+		persistedClient.m_lastPacketTimeSeconds = client->m_timeStampSecondsForLastPacketReceived;
+		++numClients;
+	}
+
+	persistedRoom.m_numClients = numClients;
+
+	int numRelays = 0;
+	std::map<AddressKey,RelaySubscriber>::iterator itRelay;
+	for ( itRelay = m_relaySubscribers.begin(); itRelay != m_relaySubscribers.end() && numRelays < MAX_RELAY_SUBSCRIBERS_PER_ROOM; ++itRelay ) {
+
+		const RelaySubscriber& subscriber = itRelay->second;
+		PersistedRelay& persistedRelay = persistedRoom.m_relays[ numRelays ];
+
+		persistedRelay.m_address = subscriber.m_address.sin_addr.s_addr;
+		persistedRelay.m_port = subscriber.m_address.sin_port;
+		persistedRelay.m_padding = 0;
+		persistedRelay.m_lastPacketTimeSeconds = subscriber.m_timeStampSecondsForLastPacketReceived;
+		++numRelays;
+	}
+
+	persistedRoom.m_numRelays = numRelays;
+
+	InterlockedIncrement( &persistedRoom.m_writeSequence );
+}
+
+
+void GameRoom::processPacket( const QueuedPacket& queuedPacket ) {
+
+	const PlayerDataPacket& playerData = queuedPacket.m_packet;
+
+	if ( playerData.m_packetID == RELAY_SUBSCRIBE_ID ) {
+
+		processRelaySubscribe( queuedPacket );
+		return;
+	}
+
+	// A relay vouches for the clients it wraps, but only while it is subscribed here. The front already
+	// dropped anything wrapped by an address that is not on the relay allowlist.
+	std::map<AddressKey,RelaySubscriber>::iterator itRelay = m_relaySubscribers.end();
+	if ( queuedPacket.m_isRelayed ) {
+
+		itRelay = m_relaySubscribers.find( makeAddressKey( queuedPacket.m_relayAddress ) );
+		if ( itRelay == m_relaySubscribers.end() ) {
+
+			InterlockedIncrement( &m_numUnsolicitedPacketsDropped );
+			return;
+		}
+	}
+
+	std::map<AddressKey,ConnectedUDPClient*>::iterator itClient;
+
+	itClient = m_clients.find( makeAddressKey( queuedPacket.m_sourceAddress ) );
+
+	if ( itClient == m_clients.end() ) {
+
+		if ( playerData.m_packetID == CONNECTION_RESPONSE_ID && queuedPacket.m_passedHandshake ) {
+
+			createClient( queuedPacket );
+
+		} else if ( playerData.m_packetID == CONNECTION_RESPONSE_ID && queuedPacket.m_isRelayed
+			&& tryAdmitRelayedClient( itRelay->second, queuedPacket.m_receiveTimeSeconds ) ) {
+
+			createClient( queuedPacket );
+
+		} else {
+
+			InterlockedIncrement( &m_numUnsolicitedPacketsDropped );
+		}
+
+		return;
+	}
+
+	// Throttle before touching any client state
+	ConnectedUDPClient* client = itClient->second;
+	if ( client->m_isRelayed != queuedPacket.m_isRelayed
+		|| ( client->m_isRelayed && makeAddressKey( client->m_relayAddress ) != makeAddressKey( queuedPacket.m_relayAddress ) ) ) {
+
+		// Same address arriving by another route than the one it joined through
+		InterlockedIncrement( &m_numUnsolicitedPacketsDropped );
+		return;
+	}
+
+	// Direct clients were already throttled by the front, relayed ones share their relay's address there
+	double currentTimeInSeconds = cbutil::getCurrentTimeSeconds();
+	if ( client->m_isRelayed && !client->m_rateLimitBucket.tryConsume( m_perClientRateLimit, currentTimeInSeconds ) ) {
+
+		++client->m_numPacketsDroppedByRateLimit;
+		InterlockedIncrement( &m_numPacketsDroppedByRateLimit );
+		return;
+	}
+
+	if ( playerData.m_packetID == RELIABLE_ACK_ID ) {
+
+		int ackCountID = playerData.m_packetAckID;
+		client->m_timeStampSecondsForLastPacketReceived = currentTimeInSeconds;
+
+		std::map<int,PlayerDataPacket>::iterator itAck;
+		itAck = client->m_reliablePacketsSentButNotAcked.find( ackCountID );
+		if ( itAck != client->m_reliablePacketsSentButNotAcked.end() ) {
+
+			client->m_reliablePacketsSentButNotAcked.erase( itAck );
+		}
+
+	} else if ( playerData.m_packetID == CONNECTION_RESPONSE_ID ) {
+
+		// Our ack was lost and the client is still echoing its cookie
+		client->m_timeStampSecondsForLastPacketReceived = currentTimeInSeconds;
+		sendNewPlayerAck( client );
+
+	} else if ( playerData.m_packetID == CONNECTION_REQUEST_ID ) {
+
+		// Already connected, nothing to hand out
+
+	} else {
+
+		// Terrible
+		client->m_timeStampSecondsForLastPacketReceived = currentTimeInSeconds;
+		m_worldState.updatePlayerPosition( client->m_worldStateIndex, playerData.m_xPos, playerData.m_yPos, queuedPacket.m_receiveTimeSeconds );
+	}
+}
+
+
+void GameRoom::createClient( const QueuedPacket& queuedPacket ) {
+
+	double currentTimeInSeconds = cbutil::getCurrentTimeSeconds();
+
+	int playerID = allocatePlayerID();
+	int worldStateIndex = INVALID_WORLD_STATE_INDEX;
+	if ( playerID != INVALID_PLAYER_ID ) {
+
+		worldStateIndex = m_worldState.addPlayer( playerID, queuedPacket.m_packet.m_xPos, queuedPacket.m_packet.m_yPos, queuedPacket.m_receiveTimeSeconds );
+	}
+
+	if ( worldStateIndex == INVALID_WORLD_STATE_INDEX ) {
+
+		releasePlayerID( playerID );
+		LOG_WARNING( LOG_MSG_ROOM_FULL, queuedPacket.m_sourceAddress, m_sessionID );
+
+		// Front already mapped this address to us, have it forget so the client can try elsewhere
+		if ( !queuedPacket.m_isRelayed ) {
+
+			EnterCriticalSection( &m_inboxLock );
+			m_departedClients.push_back( makeAddressKey( queuedPacket.m_sourceAddress ) );
+			LeaveCriticalSection( &m_inboxLock );
+		}
+		return;
+	}
+
+	ConnectedUDPClient* client = new ConnectedUDPClient( playerID );
+	client->m_clientAddress = queuedPacket.m_sourceAddress;
+	UDPServer::convertIPAndPortToSingleString( inet_ntoa( client->m_clientAddress.sin_addr ), ntohs( client->m_clientAddress.sin_port ), client->m_userID );
+	client->m_isRelayed = queuedPacket.m_isRelayed;
+	if ( queuedPacket.m_isRelayed ) {
+
+		client->m_relayAddress = queuedPacket.m_relayAddress;
+	}
+	client->m_timeStampSecondsForLastPacketReceived = currentTimeInSeconds;
+	client->m_worldStateIndex = worldStateIndex;
+	m_clients.insert( std::pair<AddressKey,ConnectedUDPClient*>( makeAddressKey( queuedPacket.m_sourceAddress ), client ) );
+	InterlockedIncrement( &m_numClients );
+	m_snapshotBuilder.invalidateBaseline();
+
+	LOG_INFO( LOG_MSG_CLIENT_JOINED_ROOM, client->m_clientAddress, m_sessionID );
+
+	sendNewPlayerAck( client );
+}
+
+
+void GameRoom::sendNewPlayerAck( ConnectedUDPClient* client ) {
+
+	int index = client->m_worldStateIndex;
+
+	PlayerDataPacket playerData;
+	playerData.m_packetID = NEW_PLAYER_ACK_ID;
+	playerData.m_playerID = client->m_playerID;
+	playerData.m_sessionID = m_sessionID;
+	playerData.m_xPos = m_worldState.m_positionX[ index ];
+	playerData.m_yPos = m_worldState.m_positionY[ index ];
+	playerData.m_red = m_worldState.m_red[ index ];
+	playerData.m_green = m_worldState.m_green[ index ];
+	playerData.m_blue = m_worldState.m_blue[ index ];
+
+	sendToClient( client, playerData );
+}
+
+
+void GameRoom::sendToClient( ConnectedUDPClient* client, const PlayerDataPacket& packet ) {
+
+	int winSockSendResult = 0;
+
+	if ( client->m_isRelayed ) {
+
+		RelayedPacket relayedPacket;
+		relayedPacket.m_clientAddress = client->m_clientAddress.sin_addr.s_addr;
+		relayedPacket.m_clientPort = client->m_clientAddress.sin_port;
+		relayedPacket.m_packet = packet;
+		winSockSendResult = sendto( m_sendSocket, (char*) &relayedPacket, sizeof( relayedPacket ), 0, (sockaddr*) &client->m_relayAddress, sizeof( client->m_relayAddress ) );
+
+	} else {
+
+		winSockSendResult = sendto( m_sendSocket, (char*) &packet, sizeof( packet ), 0, (sockaddr*) &client->m_clientAddress, sizeof( client->m_clientAddress ) );
+	}
+
+	if ( winSockSendResult == SOCKET_ERROR ) {
+
+		LOG_ERROR_RATE_LIMITED( LOG_MSG_SEND_FAILED, WSAGetLastError() );
+	}
+}
+
+
+void GameRoom::processRelaySubscribe( const QueuedPacket& queuedPacket ) {
+
+	// Relays subscribe for themselves, a wrapped subscribe would let one relay sign up another
+	if ( queuedPacket.m_isRelayed ) {
+
+		InterlockedIncrement( &m_numUnsolicitedPacketsDropped );
+		return;
+	}
+
+	double currentTimeInSeconds = cbutil::getCurrentTimeSeconds();
+
+	std::map<AddressKey,RelaySubscriber>::iterator itRelay;
+	itRelay = m_relaySubscribers.find( makeAddressKey( queuedPacket.m_sourceAddress ) );
+
+	if ( itRelay != m_relaySubscribers.end() ) {
+
+		// Keep alive
+		itRelay->second.m_timeStampSecondsForLastPacketReceived = currentTimeInSeconds;
+		return;
+	}
+
+	if ( !queuedPacket.m_passedHandshake ) {
+
+		InterlockedIncrement( &m_numUnsolicitedPacketsDropped );
+		return;
+	}
+
+	if ( static_cast<int>( m_relaySubscribers.size() ) >= MAX_RELAY_SUBSCRIBERS_PER_ROOM ) {
+
+		LOG_WARNING( LOG_MSG_ROOM_FULL, queuedPacket.m_sourceAddress, m_sessionID );
+
+		EnterCriticalSection( &m_inboxLock );
+		m_departedClients.push_back( makeAddressKey( queuedPacket.m_sourceAddress ) );
+		LeaveCriticalSection( &m_inboxLock );
+		return;
+	}
+
+	RelaySubscriber subscriber;
+	subscriber.m_address = queuedPacket.m_sourceAddress;
+	subscriber.m_timeStampSecondsForLastPacketReceived = currentTimeInSeconds;
+	subscriber.m_joinRateLimitBucket.reset();
+	m_relaySubscribers.insert( std::pair<AddressKey,RelaySubscriber>( makeAddressKey( queuedPacket.m_sourceAddress ), subscriber ) );
+
+	// The relay needs everyone before it can make sense of deltas
+	m_snapshotBuilder.invalidateBaseline();
+
+	LOG_INFO( LOG_MSG_RELAY_SUBSCRIBED, subscriber.m_address, m_sessionID );
+}
+
+
+void GameRoom::checkForExpiredClients() {
+
+	std::map<AddressKey,ConnectedUDPClient*>::iterator itClient;
+	std::vector<AddressKey> clientsToRemove;
+	std::vector<AddressKey> departedAddresses;
+
+	double currentTimeSeconds = cbutil::getCurrentTimeSeconds();
+
+	for ( itClient = m_clients.begin(); itClient != m_clients.end(); ++itClient ) {
+
+		ConnectedUDPClient* client = itClient->second;
+		double lastTimePacketReceived = client->m_timeStampSecondsForLastPacketReceived;
+
+		double secondsSinceLastPacketReceived = currentTimeSeconds - lastTimePacketReceived;
+
+		if ( secondsSinceLastPacketReceived > DURATION_THRESHOLD_FOR_DISCONECT ) {
+
+			clientsToRemove.push_back( itClient->first );
+		}
+	}
+
+	if ( clientsToRemove.empty() ) {
+
+		return;
+	}
+
+	for ( int i = 0; i < static_cast<int>( clientsToRemove.size() ); ++i ) {
+
+		std::map<AddressKey,ConnectedUDPClient*>::iterator itClientRem;
+		itClientRem = m_clients.find( clientsToRemove[i] );
+
+		if ( itClientRem != m_clients.end() ) {
+
+			ConnectedUDPClient* client = itClientRem->second;
+			LOG_INFO( LOG_MSG_CLIENT_REMOVED_INACTIVE, client->m_clientAddress );
+
+			// The front never routed a relayed client's address to us
+			if ( !client->m_isRelayed ) {
+
+				departedAddresses.push_back( makeAddressKey( client->m_clientAddress ) );
+			}
+
+			removeClientFromWorldState( client );
+			releasePlayerID( client->m_playerID );
+			delete client;
+
+			m_clients.erase( itClientRem );
+			InterlockedDecrement( &m_numClients );
+		}
+	}
+
+	// Let the front forget these addresses so they have to handshake again
+	EnterCriticalSection( &m_inboxLock );
+	m_departedClients.insert( m_departedClients.end(), departedAddresses.begin(), departedAddresses.end() );
+	LeaveCriticalSection( &m_inboxLock );
+}
+
+
+void GameRoom::checkForExpiredRelaySubscribers() {
+
+	if ( m_relaySubscribers.empty() ) {
+
+		return;
+	}
+
+	double currentTimeSeconds = cbutil::getCurrentTimeSeconds();
+	std::vector<AddressKey> relaysToRemove;
+	std::vector<AddressKey> departedRelays;
+
+	std::map<AddressKey,RelaySubscriber>::iterator itRelay;
+	for ( itRelay = m_relaySubscribers.begin(); itRelay != m_relaySubscribers.end(); ++itRelay ) {
+
+		if ( currentTimeSeconds - itRelay->second.m_timeStampSecondsForLastPacketReceived > DURATION_THRESHOLD_FOR_DISCONECT ) {
+
+			LOG_INFO( LOG_MSG_RELAY_REMOVED_INACTIVE, itRelay->second.m_address );
+			relaysToRemove.push_back( itRelay->first );
+			departedRelays.push_back( makeAddressKey( itRelay->second.m_address ) );
+		}
+	}
+
+	if ( relaysToRemove.empty() ) {
+
+		return;
+	}
+
+	// Clients behind the relay time out on their own once it stops forwarding
+	for ( int i = 0; i < static_cast<int>( relaysToRemove.size() ); ++i ) {
+
+		m_relaySubscribers.erase( relaysToRemove[i] );
+	}
+
+	EnterCriticalSection( &m_inboxLock );
+	m_departedClients.insert( m_departedClients.end(), departedRelays.begin(), departedRelays.end() );
+	LeaveCriticalSection( &m_inboxLock );
+}
+
+
+bool GameRoom::tryAdmitRelayedClient( RelaySubscriber& relay, double currentTimeSeconds ) {
+
+	// The relay ran the handshake, not us, so how many it may sign up and how fast is bounded here
+	AddressKey relayKey = makeAddressKey( relay.m_address );
+	int numClientsBehindRelay = 0;
+
+	std::map<AddressKey,ConnectedUDPClient*>::const_iterator itClient;
+	for ( itClient = m_clients.begin(); itClient != m_clients.end(); ++itClient ) {
+
+		if ( itClient->second->m_isRelayed && makeAddressKey( itClient->second->m_relayAddress ) == relayKey ) {
+
+			++numClientsBehindRelay;
+		}
+	}
+
+	// Checked first, so joins refused at the cap cost the relay no tokens
+	if ( numClientsBehindRelay >= MAX_CLIENTS_PER_RELAY ) {
+
+		return false;
+	}
+
+	return relay.m_joinRateLimitBucket.tryConsume( m_relayedJoinRateLimit, currentTimeSeconds );
+}
+
+
+int GameRoom::allocatePlayerID() {
+
+	// Lowest free ID, so no two connected players ever share one
+	for ( int bitIndex = 0; bitIndex < MAX_PLAYERS_PER_ROOM; ++bitIndex ) {
+
+		uint64_t playerIDBit = static_cast<uint64_t>( 1 ) << bitIndex;
+		if ( ( m_usedPlayerIDs & playerIDBit ) == 0 ) {
+
+			m_usedPlayerIDs |= playerIDBit;
+			return bitIndex + 1;
+		}
+	}
+
+	return INVALID_PLAYER_ID;
+}
+
+
+bool GameRoom::tryClaimPlayerID( int playerID ) {
+
+	if ( playerID < 1 || playerID > MAX_PLAYERS_PER_ROOM ) {
+
+		return false;
+	}
+
+	uint64_t playerIDBit = static_cast<uint64_t>( 1 ) << ( playerID - 1 );
+	if ( ( m_usedPlayerIDs & playerIDBit ) != 0 ) {
+
+		return false;
+	}
+
+	m_usedPlayerIDs |= playerIDBit;
+	return true;
+}
+
+
+void GameRoom::releasePlayerID( int playerID ) {
+
+	if ( playerID < 1 || playerID > MAX_PLAYERS_PER_ROOM ) {
+
+		return;
+	}
+
+	m_usedPlayerIDs &= ~( static_cast<uint64_t>( 1 ) << ( playerID - 1 ) );
+}
+
+
+void GameRoom::removeClientFromWorldState( ConnectedUDPClient* client ) {
+
+	int vacatedIndex = client->m_worldStateIndex;
+	int movedIndex = m_worldState.removePlayer( vacatedIndex );
+	client->m_worldStateIndex = INVALID_WORLD_STATE_INDEX;
+	m_snapshotBuilder.invalidateBaseline();
+
+	if ( movedIndex == INVALID_WORLD_STATE_INDEX ) {
+
+		return;
+	}
+
+	// The last slot was swapped into the hole, point its owner at the new slot
+	std::map<AddressKey,ConnectedUDPClient*>::iterator itClient;
+	for ( itClient = m_clients.begin(); itClient != m_clients.end(); ++itClient ) {
+
+		if ( itClient->second->m_worldStateIndex == movedIndex ) {
+
+			itClient->second->m_worldStateIndex = vacatedIndex;
+			break;
+		}
+	}
+}
+
+
+void GameRoom::checkForPlayersAtFlag() {
+
+	uint64_t playersAtFlag = m_worldState.findPlayersWithinRadius( m_flagPosition.x, m_flagPosition.y, FLAG_CAPTURE_RADIUS );
+	if ( playersAtFlag == 0 ) {
+
+		return;
+	}
+
+	// Lowest slot wins ties
+	for ( int i = 0; i < m_worldState.getNumPlayers(); ++i ) {
+
+		if ( ( playersAtFlag & ( static_cast<uint64_t>( 1 ) << i ) ) != 0 ) {
+
+			LOG_INFO( LOG_MSG_FLAG_REACHED, static_cast<int>( m_worldState.m_playerID[i] ), m_sessionID );
+			break;
+		}
+	}
+
+	respawnFlag();
+}
+
+
+void GameRoom::respawnFlag() {
+
+	m_flagPosition.x = cbengine::getRandomZeroToOne() * ROOM_FLAG_SPAWN_EXTENT;
+	m_flagPosition.y = cbengine::getRandomZeroToOne() * ROOM_FLAG_SPAWN_EXTENT;
+}
+
+
+void GameRoom::sendPlayerDataToClients() {
+
+	if ( m_durationSinceLastPacketUpdate > TIME_DIF_SECONDS_FOR_PACKET_UPDATE ) {
+
+		m_durationSinceLastPacketUpdate = 0.0;
+
+		if ( m_clients.empty() && m_relaySubscribers.empty() ) {
+
+			return;
+		}
+
+		// One snapshot of the whole room, identical for every client
+		int snapshotSize = m_snapshotBuilder.buildSnapshot( m_worldState, m_sessionID, m_flagPosition.x, m_flagPosition.y, m_snapshotPacketBuffer );
+		if ( snapshotSize == 0 ) {
+
+			return;
+		}
+
+		std::map<AddressKey,ConnectedUDPClient*>::iterator itClient;
+		for ( itClient = m_clients.begin(); itClient != m_clients.end(); ++itClient ) {
+
+			ConnectedUDPClient* client = itClient->second;
+
+			// Its relay fans the copy below out
+			if ( client->m_isRelayed ) {
+
+				continue;
+			}
+
+			sendSnapshot( client->m_clientAddress, snapshotSize );
+		}
+
+		std::map<AddressKey,RelaySubscriber>::iterator itRelay;
+		for ( itRelay = m_relaySubscribers.begin(); itRelay != m_relaySubscribers.end(); ++itRelay ) {
+
+			sendSnapshot( itRelay->second.m_address, snapshotSize );
+		}
+	}
+}
+
+
+void GameRoom::sendSnapshot( const sockaddr_in& destinationAddress, int snapshotSize ) {
+
+	int winSockSendResult = 0;
+
+	float randomNumberZeroToOne = cbengine::getRandomZeroToOne();
+	if ( randomNumberZeroToOne < m_thresholdForPacketLossSimulation ) {
+		// Send
+		winSockSendResult = sendto( m_sendSocket, m_snapshotPacketBuffer, snapshotSize, 0, (sockaddr*) &destinationAddress, sizeof( destinationAddress ) );
+
+	} else {
+		// Don't send but act like we did
+		// Leaving this block for testing purposes
+	}
+
+	if ( winSockSendResult == SOCKET_ERROR ) {
+
+		LOG_ERROR_RATE_LIMITED( LOG_MSG_SEND_FAILED, WSAGetLastError() );
+	}
+}
+
+
+void GameRoom::displayConnectedUsers() {
+
+	if ( m_durationSinceLastUserConnectedUpdate > TIME_DIF_SECONDS_FOR_USER_DISPLAY ) {
+
+		m_durationSinceLastUserConnectedUpdate = 0.0;
+
+		// Per room listings get noisy with many rooms, the front logs the summary at info
+		if ( !AsyncLogger::isLevelEnabled( LOG_LEVEL_DEBUG ) || m_clients.empty() ) {
+
+			return;
+		}
+
+		LOG_DEBUG( LOG_MSG_ROOM_CLIENT_LIST_BEGIN, m_sessionID );
+
+		std::map<AddressKey,ConnectedUDPClient*>::iterator itClient;
+		for ( itClient = m_clients.begin(); itClient != m_clients.end(); ++itClient ) {
+
+			ConnectedUDPClient* client = itClient->second;
+			LOG_DEBUG( LOG_MSG_CLIENT_LIST_ENTRY, client->m_clientAddress, client->m_numPacketsDroppedByRateLimit );
+		}
+
+		LOG_DEBUG( LOG_MSG_CLIENT_LIST_END );
+	}
+}
+
+
+void GameRoom::checkForExpiredReliablePacketsWithNoAcks() {
+
+	double currentTimeSeconds = cbutil::getCurrentTimeSeconds();
+
+	std::map<AddressKey,ConnectedUDPClient*>::iterator itClient;
+	for ( itClient = m_clients.begin(); itClient != m_clients.end(); ++itClient ) {
+
+		ConnectedUDPClient* client = itClient->second;
+
+		std::map<int,PlayerDataPacket>::iterator itRel;
+		for ( itRel = client->m_reliablePacketsSentButNotAcked.begin(); itRel != client->m_reliablePacketsSentButNotAcked.end(); ++itRel ) {
+
+			PlayerDataPacket& packet = itRel->second;
+			double timeStampForSendPacket = packet.m_packetTimeStamp;
+
+			double timeDifSeconds = currentTimeSeconds - timeStampForSendPacket;
+
+			if ( timeDifSeconds > TIME_THRESHOLD_TO_RESEND_RELIABLE_PACKETS ) {
+
+				packet.m_packetTimeStamp = currentTimeSeconds;
+				sendToClient( client, packet );
+			}
+		}
+	}
+}
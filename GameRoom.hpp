@@ -0,0 +1,145 @@
+#ifndef included_GameRoom
+#define included_GameRoom
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <map>
+#include <vector>
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "Ws2_32.lib")
+
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include "../../CBEngine/EngineCode/Vector2.hpp"
+
+#include "UDPServer.hpp"
+#include "RateLimiter.hpp"
+#include "WorkerPool.hpp"
+#include "WorldState.hpp"
+#include "Snapshot.hpp"
+#include "SessionStateFile.hpp"
+
+const int	MAX_QUEUED_PACKETS_PER_ROOM = 1024;
+const float ROOM_FLAG_SPAWN_EXTENT = 500.0f;
+const float FLAG_CAPTURE_RADIUS = 10.0f;
+const int	MAX_RELAY_SUBSCRIBERS_PER_ROOM = MAX_PERSISTED_RELAYS_PER_ROOM;
+const double ROOM_IDLE_TIMEOUT_SECONDS = 30.0;
+const int	INVALID_PLAYER_ID = 0; // Player IDs run from 1 to MAX_PLAYERS_PER_ROOM
+
+static_assert( MAX_PLAYERS_PER_ROOM <= 64, "Player IDs in use are tracked in a 64 bit mask" );
+
+struct QueuedPacket {
+	sockaddr_in											m_sourceAddress;
+	PlayerDataPacket									m_packet;
+	bool												m_passedHandshake; // Front validated the cookie
+	bool												m_isRelayed; // Source is the client a relay wrapped the packet for
+	sockaddr_in											m_relayAddress;
+	double												m_receiveTimeSeconds; // Taken right after recvfrom, rooms may tick much later
+};
+
+// A relay receiving this room's snapshots on behalf of its own clients
+struct RelaySubscriber {
+	sockaddr_in											m_address;
+	double												m_timeStampSecondsForLastPacketReceived;
+	TokenBucket											m_joinRateLimitBucket; // New clients the relay may sign up
+};
+
+class ConnectedUDPClient;
+
+// One independent match. The front thread only ever queues packets into the
+// inbox; everything else is touched solely from execute(), which the worker
+// pool runs on one thread at a time.
+class GameRoom : public WorkerTask {
+public:
+	virtual ~GameRoom();
+	explicit GameRoom( int sessionID, SOCKET sendSocket, const RateLimitConfig& perClientRateLimit, float packetLossThreshold, PersistedRoom* persistedRoom );
+
+	// Rebuilds clients and relays from what a previous process persisted, before the room is first
+	// ticked. Returns the client and relay addresses the front should route to this room.
+	void restoreFromPersistedRoom( std::vector<AddressKey>& out_restoredClients, std::vector<sockaddr_in>& out_restoredRelays );
+
+	// Front thread
+	bool queueIncomingPacket( const sockaddr_in& sourceAddress, const PlayerDataPacket& packet, bool passedHandshake, double receiveTimeSeconds );
+	bool queueRelayedPacket( const sockaddr_in& clientAddress, const PlayerDataPacket& packet, const sockaddr_in& relayAddress, double receiveTimeSeconds );
+	void collectDepartedClients( std::vector<AddressKey>& out_departedClients );
+	bool tryMarkTickScheduled();
+	void cancelScheduledTick(); // Only while the worker pool is stopped
+	bool isIdle( double currentTimeSeconds ); // Only while this thread holds the scheduled mark
+
+	// Worker thread, one room tick
+	virtual void execute();
+
+	int getSessionID() const { return m_sessionID; }
+	PersistedRoom* getPersistedRoom() const { return m_persistedRoom; }
+	LONG getNumClients() const { return m_numClients; }
+	LONG getNumPacketsDroppedByRateLimit() const { return m_numPacketsDroppedByRateLimit; }
+	LONG getNumUnsolicitedPacketsDropped() const { return m_numUnsolicitedPacketsDropped; }
+	LONG getNumQueueOverflowDrops() const { return m_numQueueOverflowDrops; }
+
+protected:
+
+	int													m_sessionID;
+	SOCKET												m_sendSocket;
+	RateLimitConfig										m_perClientRateLimit;
+	RateLimitConfig										m_relayedJoinRateLimit;
+	float												m_thresholdForPacketLossSimulation;
+	PersistedRoom*										m_persistedRoom; // Slot in the state file, may be null
+
+	std::map<AddressKey,ConnectedUDPClient*>			m_clients;
+	std::map<AddressKey,RelaySubscriber>				m_relaySubscribers;
+	WorldState											m_worldState;
+	SnapshotBuilder										m_snapshotBuilder;
+	char												m_snapshotPacketBuffer[ MAX_SNAPSHOT_PACKET_SIZE ];
+	cbengine::Vector2									m_flagPosition;
+	uint64_t											m_usedPlayerIDs; // Bit n set while player ID n + 1 is taken
+
+	double												m_lastTickTimeSeconds;
+	double												m_lastOccupiedTimeSeconds; // Last tick with a client or relay
+	double												m_durationSinceLastUserConnectedUpdate;
+	double												m_durationSinceLastPacketUpdate;
+
+	// Guarded by m_inboxLock
+	CRITICAL_SECTION									m_inboxLock;
+	std::vector<QueuedPacket>							m_inbox;
+	std::vector<AddressKey>								m_departedClients;
+
+	std::vector<QueuedPacket>							m_packetsBeingProcessed;
+
+	volatile LONG										m_isTickScheduled;
+	volatile LONG										m_numClients;
+	volatile LONG										m_numPacketsDroppedByRateLimit;
+	volatile LONG										m_numUnsolicitedPacketsDropped;
+	volatile LONG										m_numQueueOverflowDrops;
+
+private:
+
+	bool pushToInbox( const QueuedPacket& queuedPacket );
+	void processPacket( const QueuedPacket& queuedPacket );
+	void processRelaySubscribe( const QueuedPacket& queuedPacket );
+	void createClient( const QueuedPacket& queuedPacket );
+	bool tryAdmitRelayedClient( RelaySubscriber& relay, double currentTimeSeconds );
+	int allocatePlayerID();
+	bool tryClaimPlayerID( int playerID );
+	void releasePlayerID( int playerID );
+	void checkForExpiredClients();
+	void checkForExpiredRelaySubscribers();
+	void removeClientFromWorldState( ConnectedUDPClient* client );
+	void checkForPlayersAtFlag();
+	void respawnFlag();
+	void displayConnectedUsers();
+	void sendPlayerDataToClients();
+	void sendSnapshot( const sockaddr_in& destinationAddress, int snapshotSize );
+	void sendNewPlayerAck( ConnectedUDPClient* client );
+	void sendToClient( ConnectedUDPClient* client, const PlayerDataPacket& packet );
+	void persistState();
+
+	// Guarenteed Delivery
+	void checkForExpiredReliablePacketsWithNoAcks();
+};
+
+#endif
@@ -0,0 +1,133 @@
+// Must come before stdlib.h is pulled in for rand_s to be declared
+#define _CRT_RAND_S
+#include <stdlib.h>
+
+#include "HandshakeCookie.hpp"
+
+#include <string.h>
+#include <time.h>
+
+namespace {
+
+	inline uint64_t rotateLeft( uint64_t value, int bits ) {
+
+		return ( value << bits ) | ( value >> ( 64 - bits ) );
+	}
+
+
+	inline void sipRound( uint64_t& v0, uint64_t& v1, uint64_t& v2, uint64_t& v3 ) {
+
+		v0 += v1; v1 = rotateLeft( v1, 13 ); v1 ^= v0; v0 = rotateLeft( v0, 32 );
+		v2 += v3; v3 = rotateLeft( v3, 16 ); v3 ^= v2;
+		v0 += v3; v3 = rotateLeft( v3, 21 ); v3 ^= v0;
+		v2 += v1; v1 = rotateLeft( v1, 17 ); v1 ^= v2; v2 = rotateLeft( v2, 32 );
+	}
+}
+
+
+// The cookie input ( IPv4 address, port and epoch ) always fits in exactly one word
+uint64_t sipHashSingleWord( const uint64_t key[2], uint64_t message ) {
+
+	uint64_t v0 = key[0] ^ 0x736f6d6570736575ULL;
+	uint64_t v1 = key[1] ^ 0x646f72616e646f6dULL;
+	uint64_t v2 = key[0] ^ 0x6c7967656e657261ULL;
+	uint64_t v3 = key[1] ^ 0x7465646279746573ULL;
+
+	v3 ^= message;
+	sipRound( v0, v1, v2, v3 );
+	sipRound( v0, v1, v2, v3 );
+	v0 ^= message;
+
+	// Final block holds only the message length ( 8 bytes )
+	uint64_t lengthBlock = static_cast<uint64_t>( 8 ) << 56;
+	v3 ^= lengthBlock;
+	sipRound( v0, v1, v2, v3 );
+	sipRound( v0, v1, v2, v3 );
+	v0 ^= lengthBlock;
+
+	v2 ^= 0xff;
+	sipRound( v0, v1, v2, v3 );
+	sipRound( v0, v1, v2, v3 );
+	sipRound( v0, v1, v2, v3 );
+	sipRound( v0, v1, v2, v3 );
+
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+
+HandshakeCookieGenerator::~HandshakeCookieGenerator() {
+
+}
+
+
+HandshakeCookieGenerator::HandshakeCookieGenerator() {
+
+	m_secretKey[0] = 0;
+	m_secretKey[1] = 0;
+}
+
+
+void HandshakeCookieGenerator::initializeSecret() {
+
+	unsigned int keyWords[4];
+	for ( int i = 0; i < 4; ++i ) {
+
+		if ( rand_s( &keyWords[i] ) != 0 ) {
+
+			// rand_s should never fail on a supported OS but don't leave the key predictable
+			keyWords[i] = static_cast<unsigned int>( rand() ) ^ ( static_cast<unsigned int>( time( nullptr ) ) << ( i * 4 ) );
+		}
+	}
+
+	m_secretKey[0] = ( static_cast<uint64_t>( keyWords[0] ) << 32 ) | keyWords[1];
+	m_secretKey[1] = ( static_cast<uint64_t>( keyWords[2] ) << 32 ) | keyWords[3];
+}
+
+
+unsigned int HandshakeCookieGenerator::generateCookie( const sockaddr_in& clientAddress, double currentTimeSeconds ) const {
+
+	return computeCookieForEpoch( clientAddress, getEpochForTime( currentTimeSeconds ) );
+}
+
+
+bool HandshakeCookieGenerator::isCookieValid( unsigned int cookie, const sockaddr_in& clientAddress, double currentTimeSeconds ) const {
+
+	unsigned int currentEpoch = getEpochForTime( currentTimeSeconds );
+
+	if ( cookie == computeCookieForEpoch( clientAddress, currentEpoch ) ) {
+
+		return true;
+	}
+
+	// Cookie may have been minted just before the epoch rolled over
+	if ( currentEpoch > 0 && cookie == computeCookieForEpoch( clientAddress, currentEpoch - 1 ) ) {
+
+		return true;
+	}
+
+	return false;
+}
+
+
+unsigned int HandshakeCookieGenerator::computeCookieForEpoch( const sockaddr_in& clientAddress, unsigned int epoch ) const {
+
+	// | 32 bit IPv4 address | 16 bit port | 16 bit epoch |
+	uint64_t message = static_cast<uint64_t>( clientAddress.sin_addr.s_addr ) << 32;
+	message |= static_cast<uint64_t>( clientAddress.sin_port ) << 16;
+	message |= static_cast<uint64_t>( epoch & 0xffff );
+
+	uint64_t hash = sipHashSingleWord( m_secretKey, message );
+
+	return static_cast<unsigned int>( hash ^ ( hash >> 32 ) );
+}
+
+
+unsigned int HandshakeCookieGenerator::getEpochForTime( double currentTimeSeconds ) const {
+
+	if ( currentTimeSeconds < 0.0 ) {
+
+		return 0;
+	}
+
+	return static_cast<unsigned int>( currentTimeSeconds / COOKIE_EPOCH_DURATION_SECONDS );
+}
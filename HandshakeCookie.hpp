@@ -0,0 +1,45 @@
+#ifndef included_HandshakeCookie
+#define included_HandshakeCookie
+#pragma once
+
+#include <stdint.h>
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "Ws2_32.lib")
+
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+// Cookies are bound to a time epoch. A cookie is accepted during the epoch it
+// was minted in and the one after, so it lives between one and two epochs.
+const double COOKIE_EPOCH_DURATION_SECONDS = 10.0;
+
+// SipHash-2-4 over a single 64 bit message word, read little endian like the reference
+uint64_t sipHashSingleWord( const uint64_t key[2], uint64_t message );
+
+// Mints and validates stateless handshake cookies. The cookie is a keyed hash
+// ( SipHash-2-4 ) of the client address and the current epoch, so the server
+// does not have to remember anything about a client until it echoes one back.
+class HandshakeCookieGenerator {
+public:
+	~HandshakeCookieGenerator();
+	HandshakeCookieGenerator();
+
+	void initializeSecret();
+
+	unsigned int generateCookie( const sockaddr_in& clientAddress, double currentTimeSeconds ) const;
+	bool isCookieValid( unsigned int cookie, const sockaddr_in& clientAddress, double currentTimeSeconds ) const;
+
+protected:
+
+	uint64_t											m_secretKey[2];
+
+private:
+
+	unsigned int computeCookieForEpoch( const sockaddr_in& clientAddress, unsigned int epoch ) const;
+	unsigned int getEpochForTime( double currentTimeSeconds ) const;
+};
+
+#endif
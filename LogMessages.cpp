@@ -0,0 +1,54 @@
+#include "LogMessages.hpp"
+
+namespace {
+
+	// Order must match LogMessageID
+	const char* const LOG_MESSAGE_FORMATS[ NUM_LOG_MESSAGES ] = {
+
+		"Suppressed %u earlier repeats of the next message",
+		"Log ring for thread %u overflowed, %u records lost",
+		"A new client has been created: %A",
+		"Removing client due to inactivity. Client IP and Port: %A",
+		"send function call failed with error number: %d",
+		"---- There are currently no clients connected ----",
+		"---- Displaying List Of Connected Clients ----",
+		"Client with user ID: %A is connected to the server. Rate limited packets: %u",
+		"---- End List Of Connected Clients ----",
+		"Dropped unsolicited packets: %u  Invalid handshake cookies: %u",
+		"Rate limited packets from clients: %u  From unknown sources: %u",
+		"A new client has been created: %A in room %d",
+		"---- Displaying List Of Clients In Room %d ----",
+		"Room %d created",
+		"Room limit of %u reached, refusing session %d",
+		"%u rooms hosting %u clients on %u worker threads",
+		"Packets dropped because a room's queue was full: %u",
+		"Refusing %A, room %d is full",
+		"Refusing %A, too many rooms created recently to open room %d",
+		"Player %d reached the flag in room %d",
+		"Process %u asked to take over the socket, stopping room ticks",
+		"Handed the socket and %u rooms over to process %u",
+		"Handover to process %u timed out after %f seconds",
+		"Restored %u rooms and %u clients from the state file",
+		"Relay %A subscribed to room %d",
+		"Removing relay due to inactivity. Relay IP and Port: %A",
+		"Subscribing to room %d upstream at %A",
+		"No downstream clients left in room %d, unsubscribing",
+		"Nothing heard from upstream for room %d, handshaking again",
+		"%A joined room %d through this relay",
+		"Relaying %u rooms to %u downstream addresses, %u snapshots forwarded, %u stale dropped",
+		"Room %d has been empty for %u seconds, closing it",
+		"Relay %A claimed client %A, which is still routed through another relay, dropping",
+		"WSAPoll failed with error number: %d",
+	};
+}
+
+
+const char* getLogMessageFormat( unsigned int messageID ) {
+
+	if ( messageID >= NUM_LOG_MESSAGES ) {
+
+		return "Unknown log message ( %u %u %u %u )";
+	}
+
+	return LOG_MESSAGE_FORMATS[ messageID ];
+}
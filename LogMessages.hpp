@@ -0,0 +1,54 @@
+#ifndef included_LogMessages
+#define included_LogMessages
+#pragma once
+
+// Every log call site refers to its format string by ID so a record only has
+// to carry the ID and raw argument bits. The offline decoder uses the same
+// table, so bump LOG_MESSAGE_TABLE_VERSION whenever an entry changes meaning.
+//
+// Supported conversions: %d %u %x ( integers ), %f ( doubles ), %A ( IPv4 address and port )
+const unsigned int LOG_MESSAGE_TABLE_VERSION = 1;
+
+typedef enum {
+
+	LOG_MSG_SUPPRESSED,
+	LOG_MSG_RING_OVERFLOW,
+	LOG_MSG_CLIENT_CREATED,
+	LOG_MSG_CLIENT_REMOVED_INACTIVE,
+	LOG_MSG_SEND_FAILED,
+	LOG_MSG_NO_CLIENTS_CONNECTED,
+	LOG_MSG_CLIENT_LIST_BEGIN,
+	LOG_MSG_CLIENT_LIST_ENTRY,
+	LOG_MSG_CLIENT_LIST_END,
+	LOG_MSG_DROPPED_PACKET_TOTALS,
+	LOG_MSG_RATE_LIMITED_TOTALS,
+	LOG_MSG_CLIENT_JOINED_ROOM,
+	LOG_MSG_ROOM_CLIENT_LIST_BEGIN,
+	LOG_MSG_ROOM_CREATED,
+	LOG_MSG_ROOM_LIMIT_REACHED,
+	LOG_MSG_ROOM_SUMMARY,
+	LOG_MSG_ROOM_QUEUE_OVERFLOW_TOTALS,
+	LOG_MSG_ROOM_FULL,
+	LOG_MSG_ROOM_CREATION_THROTTLED,
+	LOG_MSG_FLAG_REACHED,
+	LOG_MSG_HANDOVER_REQUESTED,
+	LOG_MSG_HANDOVER_COMPLETE,
+	LOG_MSG_HANDOVER_TIMED_OUT,
+	LOG_MSG_STATE_RESTORED,
+	LOG_MSG_RELAY_SUBSCRIBED,
+	LOG_MSG_RELAY_REMOVED_INACTIVE,
+	LOG_MSG_RELAY_SESSION_OPENED,
+	LOG_MSG_RELAY_SESSION_CLOSED,
+	LOG_MSG_RELAY_UPSTREAM_LOST,
+	LOG_MSG_RELAY_DOWNSTREAM_JOINED,
+	LOG_MSG_RELAY_SUMMARY,
+	LOG_MSG_ROOM_RETIRED,
+	LOG_MSG_RELAY_ROUTE_CONFLICT,
+	LOG_MSG_RELAY_POLL_FAILED,
+	NUM_LOG_MESSAGES,
+
+} LogMessageID;
+
+const char* getLogMessageFormat( unsigned int messageID );
+
+#endif
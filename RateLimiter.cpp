@@ -0,0 +1,89 @@
+#include "RateLimiter.hpp"
+
+
+bool TokenBucket::tryConsume( const RateLimitConfig& config, double currentTimeSeconds ) {
+
+	unsigned int currentTimeMilliseconds = static_cast<unsigned int>( static_cast<unsigned __int64>( currentTimeSeconds * 1000.0 ) );
+
+	if ( m_tokens < 0.0f ) {
+
+		m_tokens = config.m_burstSize;
+		m_lastRefillTimeMilliseconds = currentTimeMilliseconds;
+	}
+
+	unsigned int millisecondsSinceRefill = currentTimeMilliseconds - m_lastRefillTimeMilliseconds;
+	if ( millisecondsSinceRefill > 0 ) {
+
+		m_tokens += static_cast<float>( millisecondsSinceRefill ) * 0.001f * config.m_packetsPerSecond;
+		if ( m_tokens > config.m_burstSize ) {
+
+			m_tokens = config.m_burstSize;
+		}
+
+		m_lastRefillTimeMilliseconds = currentTimeMilliseconds;
+	}
+
+	if ( m_tokens < 1.0f ) {
+
+		return false;
+	}
+
+	m_tokens -= 1.0f;
+	return true;
+}
+
+
+void TokenBucket::reset() {
+
+	m_tokens = -1.0f;
+	m_lastRefillTimeMilliseconds = 0;
+}
+
+
+UnknownSourceRateLimiter::~UnknownSourceRateLimiter() {
+
+}
+
+
+UnknownSourceRateLimiter::UnknownSourceRateLimiter() {
+
+	for ( int i = 0; i < UNKNOWN_SOURCE_TABLE_SIZE; ++i ) {
+
+		m_slots[i].m_address = 0;
+		m_slots[i].m_port = 0;
+		m_slots[i].m_bucket.reset();
+	}
+
+	m_allSourcesBucket.reset();
+}
+
+
+bool UnknownSourceRateLimiter::tryConsume( const sockaddr_in& sourceAddress, const RateLimitConfig& perSourceConfig, const RateLimitConfig& allSourcesConfig, double currentTimeSeconds ) {
+
+	SourceSlot& slot = m_slots[ getSlotIndex( sourceAddress ) ];
+
+	if ( slot.m_address != sourceAddress.sin_addr.s_addr || slot.m_port != sourceAddress.sin_port ) {
+
+		slot.m_address = sourceAddress.sin_addr.s_addr;
+		slot.m_port = sourceAddress.sin_port;
+		slot.m_bucket.reset();
+	}
+
+	if ( !slot.m_bucket.tryConsume( perSourceConfig, currentTimeSeconds ) ) {
+
+		return false;
+	}
+
+	// Spoofed floods rotate addresses, so cap unknown traffic as a whole as well
+	return m_allSourcesBucket.tryConsume( allSourcesConfig, currentTimeSeconds );
+}
+
+
+int UnknownSourceRateLimiter::getSlotIndex( const sockaddr_in& sourceAddress ) const {
+
+	unsigned int hash = static_cast<unsigned int>( sourceAddress.sin_addr.s_addr ) * 2654435761u;
+	hash ^= static_cast<unsigned int>( sourceAddress.sin_port ) * 40503u;
+	hash ^= hash >> 16;
+
+	return static_cast<int>( hash & ( UNKNOWN_SOURCE_TABLE_SIZE - 1 ) );
+}
@@ -0,0 +1,76 @@
+#ifndef included_RateLimiter
+#define included_RateLimiter
+#pragma once
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "Ws2_32.lib")
+
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+struct RateLimitConfig {
+public:
+	RateLimitConfig() :
+	  m_packetsPerSecond( 0.0f ),
+		  m_burstSize( 0.0f )
+	  {}
+
+	RateLimitConfig( float packetsPerSecond, float burstSize ) :
+	  m_packetsPerSecond( packetsPerSecond ),
+		  m_burstSize( burstSize )
+	  {}
+
+	  float				m_packetsPerSecond;
+	  float				m_burstSize;
+};
+
+// Defaults sit comfortably above what a well behaved client sends per tick
+const float DEFAULT_CLIENT_PACKETS_PER_SECOND = 300.0f;
+const float DEFAULT_CLIENT_BURST_SIZE = 60.0f;
+const float DEFAULT_UNKNOWN_SOURCE_PACKETS_PER_SECOND = 4.0f;
+const float DEFAULT_UNKNOWN_SOURCE_BURST_SIZE = 8.0f;
+const float DEFAULT_ALL_UNKNOWN_SOURCES_PACKETS_PER_SECOND = 2000.0f;
+const float DEFAULT_ALL_UNKNOWN_SOURCES_BURST_SIZE = 200.0f;
+
+const int	UNKNOWN_SOURCE_TABLE_SIZE = 256; // Must be a power of two
+
+// 8 bytes so it can live inside the client record without bloating it.
+// Kept POD so function statics can be constant initialised, call reset() before first use.
+struct TokenBucket {
+public:
+	  bool tryConsume( const RateLimitConfig& config, double currentTimeSeconds );
+	  void reset();
+
+	  float				m_tokens; // Negative until first use, bucket starts full
+	  unsigned int		m_lastRefillTimeMilliseconds; // Wraps, only differences are used
+};
+
+// Fixed size table of buckets for addresses that have no client record yet.
+// Slots are indexed by a hash of the address and a new address simply takes
+// over whichever slot it lands on, so memory stays bounded under floods.
+class UnknownSourceRateLimiter {
+public:
+	~UnknownSourceRateLimiter();
+	UnknownSourceRateLimiter();
+
+	bool tryConsume( const sockaddr_in& sourceAddress, const RateLimitConfig& perSourceConfig, const RateLimitConfig& allSourcesConfig, double currentTimeSeconds );
+
+protected:
+
+	struct SourceSlot {
+		u_long											m_address;
+		u_short											m_port;
+		TokenBucket										m_bucket;
+	};
+
+	SourceSlot											m_slots[ UNKNOWN_SOURCE_TABLE_SIZE ];
+	TokenBucket											m_allSourcesBucket;
+
+private:
+
+	int getSlotIndex( const sockaddr_in& sourceAddress ) const;
+};
+
+#endif
@@ -0,0 +1,187 @@
+#include "SessionStateFile.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
+namespace {
+
+	const DWORD STATE_FILE_SIZE = static_cast<DWORD>( sizeof( StateFileHeader ) + MAX_PERSISTED_ROOMS * sizeof( PersistedRoom ) );
+}
+
+
+SessionStateFile::~SessionStateFile() {
+
+	close();
+}
+
+
+SessionStateFile::SessionStateFile() {
+
+	m_fileHandle = INVALID_HANDLE_VALUE;
+	m_mappingHandle = nullptr;
+	m_header = nullptr;
+	m_rooms = nullptr;
+}
+
+
+bool SessionStateFile::create( const std::string& filePath ) {
+
+	if ( !mapFile( filePath, CREATE_ALWAYS ) ) {
+
+		return false;
+	}
+
+	memset( m_header, 0, STATE_FILE_SIZE );
+	m_header->m_version = STATE_FILE_VERSION;
+	m_header->m_headerSize = sizeof( StateFileHeader );
+	m_header->m_roomSize = sizeof( PersistedRoom );
+	m_header->m_numRooms = 0;
+	m_header->m_handoverState = HANDOVER_STATE_NONE;
+
+	// Magic goes in last so a half written file is never mistaken for a valid one
+	MemoryBarrier();
+	memcpy( m_header->m_magic, STATE_FILE_MAGIC, sizeof( m_header->m_magic ) );
+
+	return true;
+}
+
+
+bool SessionStateFile::openExisting( const std::string& filePath ) {
+
+	if ( !mapFile( filePath, OPEN_EXISTING ) ) {
+
+		return false;
+	}
+
+	if ( memcmp( m_header->m_magic, STATE_FILE_MAGIC, sizeof( m_header->m_magic ) ) != 0
+		|| m_header->m_version != STATE_FILE_VERSION
+		|| m_header->m_headerSize != sizeof( StateFileHeader )
+		|| m_header->m_roomSize != sizeof( PersistedRoom ) ) {
+
+		printf( "State file %s was written by an incompatible server version\n", filePath.c_str() );
+		close();
+		return false;
+	}
+
+	return true;
+}
+
+
+void SessionStateFile::close() {
+
+	if ( m_header != nullptr ) {
+
+		FlushViewOfFile( m_header, 0 );
+		UnmapViewOfFile( m_header );
+		m_header = nullptr;
+		m_rooms = nullptr;
+	}
+
+	m_freeRoomSlots.clear();
+
+	if ( m_mappingHandle != nullptr ) {
+
+		CloseHandle( m_mappingHandle );
+		m_mappingHandle = nullptr;
+	}
+
+	if ( m_fileHandle != INVALID_HANDLE_VALUE ) {
+
+		CloseHandle( m_fileHandle );
+		m_fileHandle = INVALID_HANDLE_VALUE;
+	}
+}
+
+
+PersistedRoom* SessionStateFile::getRoom( int roomSlot ) {
+
+	if ( m_rooms == nullptr || roomSlot < 0 || roomSlot >= MAX_PERSISTED_ROOMS ) {
+
+		return nullptr;
+	}
+
+	return &m_rooms[ roomSlot ];
+}
+
+
+PersistedRoom* SessionStateFile::acquireRoom() {
+
+	if ( m_header == nullptr ) {
+
+		return nullptr;
+	}
+
+	if ( !m_freeRoomSlots.empty() ) {
+
+		int roomSlot = m_freeRoomSlots.back();
+		m_freeRoomSlots.pop_back();
+		return &m_rooms[ roomSlot ];
+	}
+
+	if ( m_header->m_numRooms >= MAX_PERSISTED_ROOMS ) {
+
+		return nullptr;
+	}
+
+	int roomSlot = InterlockedIncrement( &m_header->m_numRooms ) - 1;
+	return &m_rooms[ roomSlot ];
+}
+
+
+void SessionStateFile::releaseRoom( PersistedRoom* persistedRoom ) {
+
+	if ( m_rooms == nullptr || persistedRoom < m_rooms || persistedRoom >= m_rooms + MAX_PERSISTED_ROOMS ) {
+
+		return;
+	}
+
+	// A zero sequence reads as never written, so a restore skips the slot until it is handed out again
+	InterlockedExchange( &persistedRoom->m_writeSequence, 0 );
+	persistedRoom->m_sessionID = 0;
+	persistedRoom->m_numClients = 0;
+	persistedRoom->m_numRelays = 0;
+
+	m_freeRoomSlots.push_back( static_cast<int>( persistedRoom - m_rooms ) );
+}
+
+
+bool SessionStateFile::mapFile( const std::string& filePath, DWORD creationDisposition ) {
+
+	close();
+
+	// Both the old and new process map the file during a handover
+	m_fileHandle = CreateFileA( filePath.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, creationDisposition, FILE_ATTRIBUTE_NORMAL, nullptr );
+	if ( m_fileHandle == INVALID_HANDLE_VALUE ) {
+
+		printf( "Unable to open state file %s, error number: %lu\n", filePath.c_str(), GetLastError() );
+		return false;
+	}
+
+	if ( creationDisposition == OPEN_EXISTING && GetFileSize( m_fileHandle, nullptr ) != STATE_FILE_SIZE ) {
+
+		printf( "State file %s has an unexpected size\n", filePath.c_str() );
+		close();
+		return false;
+	}
+
+	m_mappingHandle = CreateFileMappingA( m_fileHandle, nullptr, PAGE_READWRITE, 0, STATE_FILE_SIZE, nullptr );
+	if ( m_mappingHandle == nullptr ) {
+
+		printf( "CreateFileMapping failed with error number: %lu\n", GetLastError() );
+		close();
+		return false;
+	}
+
+	void* view = MapViewOfFile( m_mappingHandle, FILE_MAP_ALL_ACCESS, 0, 0, STATE_FILE_SIZE );
+	if ( view == nullptr ) {
+
+		printf( "MapViewOfFile failed with error number: %lu\n", GetLastError() );
+		close();
+		return false;
+	}
+
+	m_header = static_cast<StateFileHeader*>( view );
+	m_rooms = reinterpret_cast<PersistedRoom*>( static_cast<char*>( view ) + sizeof( StateFileHeader ) );
+
+	return true;
+}
@@ -0,0 +1,123 @@
+#ifndef included_SessionStateFile
+#define included_SessionStateFile
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "Ws2_32.lib")
+
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include "WorldState.hpp"
+
+const char			STATE_FILE_MAGIC[4] = { 'F', 'B', 'S', 'T' };
+const uint32_t		STATE_FILE_VERSION = 2; // Bump whenever a persisted struct changes
+const int			MAX_PERSISTED_ROOMS = 512;
+const int			MAX_PERSISTED_RELAYS_PER_ROOM = 16;
+const double		HANDOVER_TIMEOUT_SECONDS = 3.0;
+
+// READY only ever leaves through a compare exchange, to COMPLETE by the new process or back to
+// NONE by the old one giving up, so exactly one of them ends up serving.
+typedef enum {
+
+	HANDOVER_STATE_NONE,
+	HANDOVER_STATE_REQUESTED,	// New process wrote its PID and wants the socket
+	HANDOVER_STATE_READY,		// Old process stopped ticking and duplicated the socket
+	HANDOVER_STATE_COMPLETE,	// New process owns the socket, old process may exit
+
+} HandoverState;
+
+struct PersistedClient {
+	uint32_t			m_address; // Network order
+	uint16_t			m_port; // Network order
+	uint16_t			m_relayPort; // Network order, 0 when the client talks to us directly
+	uint32_t			m_relayAddress; // Network order
+	int32_t				m_playerID;
+	float				m_xPosition;
+	float				m_yPosition;
+	float				m_xVelocity;
+	float				m_yVelocity;
+	float				m_yawDegrees;
+	unsigned char		m_red;
+	unsigned char		m_green;
+	unsigned char		m_blue;
+	unsigned char		m_padding2;
+	double				m_lastPacketTimeSeconds; // Writer's clock, compare with m_writeTimeSeconds
+};
+
+struct PersistedRelay {
+	uint32_t			m_address; // Network order
+	uint16_t			m_port; // Network order
+	uint16_t			m_padding;
+	double				m_lastPacketTimeSeconds; // Writer's clock
+};
+
+// Written by the owning room at the end of each tick. m_writeSequence is odd
+// while a write is in progress, so a reader can skip a torn room after a crash.
+struct PersistedRoom {
+	volatile LONG		m_writeSequence;
+	int32_t				m_sessionID;
+	int32_t				m_numClients;
+	float				m_flagXPosition;
+	float				m_flagYPosition;
+	int32_t				m_numRelays;
+	double				m_writeTimeSeconds;
+	PersistedClient		m_clients[ MAX_PLAYERS_PER_ROOM ];
+	PersistedRelay		m_relays[ MAX_PERSISTED_RELAYS_PER_ROOM ];
+};
+
+struct StateFileHeader {
+	char				m_magic[4];
+	uint32_t			m_version;
+	uint32_t			m_headerSize;
+	uint32_t			m_roomSize;
+	volatile LONG		m_numRooms;
+	volatile LONG		m_handoverState;
+	DWORD				m_handoverRequestPID;
+	DWORD				m_padding;
+	WSAPROTOCOL_INFOW	m_socketProtocolInfo;
+};
+
+// Session table for every room, kept in a file backed mapping so a
+// replacement process can pick up where this one left off.
+class SessionStateFile {
+public:
+	~SessionStateFile();
+	SessionStateFile();
+
+	// Truncates any previous state
+	bool create( const std::string& filePath );
+
+	// Maps state left by a running or crashed process, fails on a layout mismatch
+	bool openExisting( const std::string& filePath );
+
+	void close();
+
+	bool isOpen() const { return m_header != nullptr; }
+	StateFileHeader* getHeader() { return m_header; }
+	PersistedRoom* getRoom( int roomSlot );
+
+	// Hands out a slot a retired room gave back before growing the file's room count
+	PersistedRoom* acquireRoom();
+	void releaseRoom( PersistedRoom* persistedRoom );
+
+protected:
+
+	HANDLE												m_fileHandle;
+	HANDLE												m_mappingHandle;
+	StateFileHeader*									m_header;
+	PersistedRoom*										m_rooms;
+	std::vector<int>									m_freeRoomSlots;
+
+private:
+
+	bool mapFile( const std::string& filePath, DWORD creationDisposition );
+};
+
+#endif
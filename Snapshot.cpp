@@ -0,0 +1,298 @@
+#include "Snapshot.hpp"
+
+#include <string.h>
+
+#include <emmintrin.h>
+
+#include "UDPServer.hpp"
+
+namespace {
+
+	// Eight int16 lanes per SSE register
+	inline int roundUpToEightPlayers( int numPlayers ) {
+
+		return ( numPlayers + 7 ) & ~7;
+	}
+
+
+	// Scales eight floats, rounds to nearest and saturates into int16
+	inline void quantizeEightLanes( const float* source, __m128 scale, int16_t* out_destination ) {
+
+		__m128i lowLanes = _mm_cvtps_epi32( _mm_mul_ps( _mm_loadu_ps( source ), scale ) );
+		__m128i highLanes = _mm_cvtps_epi32( _mm_mul_ps( _mm_loadu_ps( source + 4 ), scale ) );
+		_mm_storeu_si128( reinterpret_cast<__m128i*>( out_destination ), _mm_packs_epi32( lowLanes, highLanes ) );
+	}
+
+
+	inline __m128i compareEightLanes( const int16_t* current, const int16_t* lastSent ) {
+
+		return _mm_cmpeq_epi16( _mm_loadu_si128( reinterpret_cast<const __m128i*>( current ) ), _mm_loadu_si128( reinterpret_cast<const __m128i*>( lastSent ) ) );
+	}
+
+
+	inline short quantizeScalar( float value, float scale ) {
+
+		float scaled = value * scale;
+		if ( scaled > 32767.0f ) {
+
+			return 32767;
+		}
+
+		if ( scaled < -32768.0f ) {
+
+			return -32768;
+		}
+
+		return static_cast<short>( scaled < 0.0f ? scaled - 0.5f : scaled + 0.5f );
+	}
+}
+
+
+SnapshotBuilder::~SnapshotBuilder() {
+
+}
+
+
+SnapshotBuilder::SnapshotBuilder() {
+
+	memset( m_quantizedX, 0, sizeof( m_quantizedX ) );
+	memset( m_quantizedY, 0, sizeof( m_quantizedY ) );
+	memset( m_quantizedVelocityX, 0, sizeof( m_quantizedVelocityX ) );
+	memset( m_quantizedVelocityY, 0, sizeof( m_quantizedVelocityY ) );
+	memset( m_quantizedYaw, 0, sizeof( m_quantizedYaw ) );
+	rememberSentState();
+
+	m_sequence = 0;
+	m_ticksSinceFullSnapshot = 0;
+	m_forceFullSnapshot = true;
+}
+
+
+int SnapshotBuilder::buildSnapshot( const WorldState& worldState, int sessionID, float flagXPosition, float flagYPosition, char* out_packetBuffer ) {
+
+	int numPlayers = worldState.getNumPlayers();
+	int numPlayersPadded = roundUpToEightPlayers( numPlayers );
+
+	quantizeWorldState( worldState, numPlayersPadded );
+
+	++m_ticksSinceFullSnapshot;
+	bool isFullSnapshot = m_forceFullSnapshot || m_ticksSinceFullSnapshot >= TICKS_BETWEEN_FULL_SNAPSHOTS;
+
+	uint64_t playersToSend = 0;
+	if ( isFullSnapshot ) {
+
+		playersToSend = ( numPlayers >= 64 ) ? ~static_cast<uint64_t>( 0 ) : ( static_cast<uint64_t>( 1 ) << numPlayers ) - 1;
+
+	} else {
+
+		playersToSend = findChangedPlayers( numPlayersPadded );
+		if ( numPlayers < 64 ) {
+
+			playersToSend &= ( static_cast<uint64_t>( 1 ) << numPlayers ) - 1;
+		}
+
+		if ( playersToSend == 0 ) {
+
+			return 0;
+		}
+	}
+
+	SnapshotHeader* header = reinterpret_cast<SnapshotHeader*>( out_packetBuffer );
+	header->m_packetID = SNAPSHOT_PACKET_ID;
+	header->m_flags = isFullSnapshot ? SNAPSHOT_FLAG_FULL : 0;
+	header->m_padding = 0;
+	header->m_sessionID = sessionID;
+	header->m_sequence = ++m_sequence;
+	header->m_flagXPosition = quantizeScalar( flagXPosition, POSITION_QUANTIZATION_SCALE );
+	header->m_flagYPosition = quantizeScalar( flagYPosition, POSITION_QUANTIZATION_SCALE );
+
+	// Pack only the lanes the diff selected
+	SnapshotEntry* entries = reinterpret_cast<SnapshotEntry*>( out_packetBuffer + sizeof( SnapshotHeader ) );
+	int numEntries = 0;
+
+	for ( int i = 0; i < numPlayers; ++i ) {
+
+		if ( ( playersToSend & ( static_cast<uint64_t>( 1 ) << i ) ) == 0 ) {
+
+			continue;
+		}
+
+		SnapshotEntry& entry = entries[ numEntries ];
+		entry.m_playerID = worldState.m_playerID[i];
+		entry.m_yaw = static_cast<unsigned char>( m_quantizedYaw[i] );
+		entry.m_xPosition = m_quantizedX[i];
+		entry.m_yPosition = m_quantizedY[i];
+		entry.m_xVelocity = m_quantizedVelocityX[i];
+		entry.m_yVelocity = m_quantizedVelocityY[i];
+		entry.m_red = worldState.m_red[i];
+		entry.m_green = worldState.m_green[i];
+		entry.m_blue = worldState.m_blue[i];
+		++numEntries;
+	}
+
+	header->m_numEntries = static_cast<unsigned char>( numEntries );
+
+	rememberSentState();
+	if ( isFullSnapshot ) {
+
+		m_forceFullSnapshot = false;
+		m_ticksSinceFullSnapshot = 0;
+	}
+
+	return static_cast<int>( sizeof( SnapshotHeader ) + numEntries * sizeof( SnapshotEntry ) );
+}
+
+
+void SnapshotBuilder::quantizeWorldState( const WorldState& worldState, int numPlayersPadded ) {
+
+	__m128 positionScale = _mm_set1_ps( POSITION_QUANTIZATION_SCALE );
+	__m128 velocityScale = _mm_set1_ps( VELOCITY_QUANTIZATION_SCALE );
+	__m128 yawScale = _mm_set1_ps( YAW_QUANTIZATION_SCALE );
+	__m128i yawWrapMask = _mm_set1_epi16( 0xff );
+
+	for ( int i = 0; i < numPlayersPadded; i += 8 ) {
+
+		quantizeEightLanes( &worldState.m_positionX[i], positionScale, &m_quantizedX[i] );
+		quantizeEightLanes( &worldState.m_positionY[i], positionScale, &m_quantizedY[i] );
+		quantizeEightLanes( &worldState.m_velocityX[i], velocityScale, &m_quantizedVelocityX[i] );
+		quantizeEightLanes( &worldState.m_velocityY[i], velocityScale, &m_quantizedVelocityY[i] );
+		quantizeEightLanes( &worldState.m_yawDegrees[i], yawScale, &m_quantizedYaw[i] );
+
+		// 360 degrees rounds up to 256, wrap it back to 0
+		__m128i yaw = _mm_loadu_si128( reinterpret_cast<const __m128i*>( &m_quantizedYaw[i] ) );
+		_mm_storeu_si128( reinterpret_cast<__m128i*>( &m_quantizedYaw[i] ), _mm_and_si128( yaw, yawWrapMask ) );
+	}
+}
+
+
+uint64_t SnapshotBuilder::findChangedPlayers( int numPlayersPadded ) const {
+
+	uint64_t changedPlayers = 0;
+
+	for ( int i = 0; i < numPlayersPadded; i += 8 ) {
+
+		__m128i unchanged = compareEightLanes( &m_quantizedX[i], &m_lastSentX[i] );
+		unchanged = _mm_and_si128( unchanged, compareEightLanes( &m_quantizedY[i], &m_lastSentY[i] ) );
+		unchanged = _mm_and_si128( unchanged, compareEightLanes( &m_quantizedVelocityX[i], &m_lastSentVelocityX[i] ) );
+		unchanged = _mm_and_si128( unchanged, compareEightLanes( &m_quantizedVelocityY[i], &m_lastSentVelocityY[i] ) );
+		unchanged = _mm_and_si128( unchanged, compareEightLanes( &m_quantizedYaw[i], &m_lastSentYaw[i] ) );
+
+		// Narrow each 16 bit lane to a byte so movemask yields one bit per player
+		int unchangedBits = _mm_movemask_epi8( _mm_packs_epi16( unchanged, _mm_setzero_si128() ) ) & 0xff;
+		changedPlayers |= static_cast<uint64_t>( ~unchangedBits & 0xff ) << i;
+	}
+
+	return changedPlayers;
+}
+
+
+void SnapshotBuilder::rememberSentState() {
+
+	memcpy( m_lastSentX, m_quantizedX, sizeof( m_lastSentX ) );
+	memcpy( m_lastSentY, m_quantizedY, sizeof( m_lastSentY ) );
+	memcpy( m_lastSentVelocityX, m_quantizedVelocityX, sizeof( m_lastSentVelocityX ) );
+	memcpy( m_lastSentVelocityY, m_quantizedVelocityY, sizeof( m_lastSentVelocityY ) );
+	memcpy( m_lastSentYaw, m_quantizedYaw, sizeof( m_lastSentYaw ) );
+}
+
+
+SnapshotCache::~SnapshotCache() {
+
+}
+
+
+SnapshotCache::SnapshotCache() {
+
+	memset( &m_header, 0, sizeof( m_header ) );
+	m_hasFullState = false;
+	clearEntries();
+}
+
+
+bool SnapshotCache::applySnapshot( const char* packetBuffer, int packetSize ) {
+
+	if ( packetSize < static_cast<int>( sizeof( SnapshotHeader ) ) ) {
+
+		return false;
+	}
+
+	SnapshotHeader header;
+	memcpy( &header, packetBuffer, sizeof( header ) );
+
+	int numEntries = header.m_numEntries;
+	if ( header.m_packetID != SNAPSHOT_PACKET_ID
+		|| numEntries > MAX_PLAYERS_PER_ROOM
+		|| packetSize != static_cast<int>( sizeof( SnapshotHeader ) + numEntries * sizeof( SnapshotEntry ) ) ) {
+
+		return false;
+	}
+
+	bool isFullSnapshot = ( header.m_flags & SNAPSHOT_FLAG_FULL ) != 0;
+
+	// Full snapshots are always taken, a restarted server starts its sequence over
+	if ( !isFullSnapshot && m_hasFullState && static_cast<int>( header.m_sequence - m_header.m_sequence ) <= 0 ) {
+
+		return false;
+	}
+
+	const SnapshotEntry* entries = reinterpret_cast<const SnapshotEntry*>( packetBuffer + sizeof( SnapshotHeader ) );
+
+	if ( isFullSnapshot ) {
+
+		clearEntries();
+		m_hasFullState = true;
+
+	} else if ( !m_hasFullState ) {
+
+		// Nothing to apply a delta to yet, still worth passing on
+		return true;
+	}
+
+	for ( int i = 0; i < numEntries; ++i ) {
+
+		SnapshotEntry entry;
+		memcpy( &entry, &entries[i], sizeof( entry ) );
+
+		int entryIndex = m_entryIndexForPlayerID[ entry.m_playerID ];
+		if ( entryIndex == NO_CACHED_ENTRY ) {
+
+			if ( m_numEntries >= MAX_PLAYERS_PER_ROOM ) {
+
+				continue;
+			}
+
+			entryIndex = m_numEntries++;
+			m_entryIndexForPlayerID[ entry.m_playerID ] = static_cast<signed char>( entryIndex );
+		}
+
+		m_entries[ entryIndex ] = entry;
+	}
+
+	m_header = header;
+	return true;
+}
+
+
+int SnapshotCache::buildFullSnapshot( char* out_packetBuffer ) const {
+
+	if ( !m_hasFullState ) {
+
+		return 0;
+	}
+
+	SnapshotHeader header = m_header;
+	header.m_flags = SNAPSHOT_FLAG_FULL;
+	header.m_numEntries = static_cast<unsigned char>( m_numEntries );
+
+	memcpy( out_packetBuffer, &header, sizeof( header ) );
+	memcpy( out_packetBuffer + sizeof( SnapshotHeader ), m_entries, m_numEntries * sizeof( SnapshotEntry ) );
+
+	return static_cast<int>( sizeof( SnapshotHeader ) + m_numEntries * sizeof( SnapshotEntry ) );
+}
+
+
+void SnapshotCache::clearEntries() {
+
+	m_numEntries = 0;
+	memset( m_entryIndexForPlayerID, NO_CACHED_ENTRY, sizeof( m_entryIndexForPlayerID ) );
+}
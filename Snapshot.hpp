@@ -0,0 +1,117 @@
+#ifndef included_Snapshot
+#define included_Snapshot
+#pragma once
+
+#include <stdint.h>
+
+#include "WorldState.hpp"
+
+const float POSITION_QUANTIZATION_SCALE = 8.0f; // 1/8 unit steps, +-4095 units
+const float VELOCITY_QUANTIZATION_SCALE = 16.0f;
+const float YAW_QUANTIZATION_SCALE = 256.0f / 360.0f;
+const int	TICKS_BETWEEN_FULL_SNAPSHOTS = 20;
+
+const unsigned char SNAPSHOT_FLAG_FULL = 1; // Every live player is listed, absent players have left
+
+#pragma pack( push, 1 )
+
+struct SnapshotHeader {
+	unsigned char		m_packetID;
+	unsigned char		m_flags;
+	unsigned char		m_numEntries;
+	unsigned char		m_padding;
+	int					m_sessionID;
+	unsigned int		m_sequence;
+	short				m_flagXPosition;
+	short				m_flagYPosition;
+};
+
+struct SnapshotEntry {
+	unsigned char		m_playerID;
+	unsigned char		m_yaw;
+	short				m_xPosition;
+	short				m_yPosition;
+	short				m_xVelocity;
+	short				m_yVelocity;
+	unsigned char		m_red;
+	unsigned char		m_green;
+	unsigned char		m_blue;
+};
+
+#pragma pack( pop )
+
+const int MAX_SNAPSHOT_PACKET_SIZE = sizeof( SnapshotHeader ) + MAX_PLAYERS_PER_ROOM * sizeof( SnapshotEntry );
+
+// Turns a room's WorldState into snapshot packets. Quantizing and change
+// detection run in SSE2 over every player at once. Between full snapshots only
+// players whose quantized state moved are listed. Entries always carry absolute
+// values, so a lost packet is repaired by the next update or full snapshot.
+class SnapshotBuilder {
+public:
+	~SnapshotBuilder();
+	SnapshotBuilder();
+
+	// Player slots were added, removed or reordered, so the next snapshot lists everyone
+	void invalidateBaseline() { m_forceFullSnapshot = true; }
+
+	// Returns the packet size, or 0 when nothing changed since the last snapshot
+	int buildSnapshot( const WorldState& worldState, int sessionID, float flagXPosition, float flagYPosition, char* out_packetBuffer );
+
+protected:
+
+	int16_t												m_quantizedX[ MAX_PLAYERS_PER_ROOM ];
+	int16_t												m_quantizedY[ MAX_PLAYERS_PER_ROOM ];
+	int16_t												m_quantizedVelocityX[ MAX_PLAYERS_PER_ROOM ];
+	int16_t												m_quantizedVelocityY[ MAX_PLAYERS_PER_ROOM ];
+	int16_t												m_quantizedYaw[ MAX_PLAYERS_PER_ROOM ];
+
+	int16_t												m_lastSentX[ MAX_PLAYERS_PER_ROOM ];
+	int16_t												m_lastSentY[ MAX_PLAYERS_PER_ROOM ];
+	int16_t												m_lastSentVelocityX[ MAX_PLAYERS_PER_ROOM ];
+	int16_t												m_lastSentVelocityY[ MAX_PLAYERS_PER_ROOM ];
+	int16_t												m_lastSentYaw[ MAX_PLAYERS_PER_ROOM ];
+
+	unsigned int										m_sequence;
+	int													m_ticksSinceFullSnapshot;
+	bool												m_forceFullSnapshot;
+
+private:
+
+	void quantizeWorldState( const WorldState& worldState, int numPlayersPadded );
+	uint64_t findChangedPlayers( int numPlayersPadded ) const;
+	void rememberSentState();
+};
+
+
+const int NO_CACHED_ENTRY = -1;
+
+// Latest state of one room rebuilt from its snapshot stream, so a relay can
+// hand a full snapshot to anyone who joins between the server's full ones.
+class SnapshotCache {
+public:
+	~SnapshotCache();
+	SnapshotCache();
+
+	// Returns false for malformed packets and for deltas no newer than the cached state,
+	// neither of which should be passed on
+	bool applySnapshot( const char* packetBuffer, int packetSize );
+
+	// Returns the packet size, or 0 until a full snapshot has been seen
+	int buildFullSnapshot( char* out_packetBuffer ) const;
+
+	bool hasFullState() const { return m_hasFullState; }
+
+protected:
+
+	SnapshotHeader										m_header;
+	SnapshotEntry										m_entries[ MAX_PLAYERS_PER_ROOM ];
+	int													m_numEntries;
+	signed char											m_entryIndexForPlayerID[ 256 ];
+	bool												m_hasFullState;
+
+private:
+
+	void clearEntries();
+};
+
+#endif
@@ -0,0 +1,978 @@
+#include "SnapshotRelay.hpp"
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+#include <algorithm>
+
+#include "AsyncLogger.hpp"
+
+#include "../../CBEngine/EngineCode/TimeUtil.hpp"
+
+namespace {
+
+	const int MAX_DOWNSTREAM_PER_SESSION = 256; // Spectators and relays, players are capped by the upstream room
+
+	bool isDownstreamPacketID( unsigned char packetID ) {
+
+		return packetID == PLAYER_DATA_PACKET_ID
+			|| packetID == PLAYER_EXIT_DATA_PACKET_ID
+			|| packetID == RELIABLE_ACK_ID
+			|| packetID == CONNECTION_REQUEST_ID
+			|| packetID == CONNECTION_RESPONSE_ID
+			|| packetID == RELAY_SUBSCRIBE_ID
+			|| packetID == RELAYED_PACKET_ID;
+	}
+
+
+	bool isSameAddress( const sockaddr_in& first, const sockaddr_in& second ) {
+
+		return first.sin_addr.s_addr == second.sin_addr.s_addr && first.sin_port == second.sin_port;
+	}
+}
+
+
+SnapshotRelay::~SnapshotRelay() {
+
+	while ( !m_sessions.empty() ) {
+
+		closeSession( m_sessions.begin()->second );
+	}
+}
+
+
+SnapshotRelay::SnapshotRelay( const std::string& ipAddress, const std::string& portNumber, const std::string& upstreamIPAddress, const std::string& upstreamPortNumber ) {
+
+	m_listenSocket = INVALID_SOCKET;
+
+	m_IPAddress = ipAddress;
+	m_PortNumber = portNumber;
+	m_upstreamIPAddress = upstreamIPAddress;
+	m_upstreamPortNumber = upstreamPortNumber;
+	ZeroMemory( &m_upstreamAddress, sizeof( m_upstreamAddress ) );
+
+	m_relayShouldRun = false;
+	m_lastMaintenanceTimeSeconds = 0.0;
+	m_durationSinceLastSummary = 0.0;
+
+	m_numUnsolicitedPacketsDropped = 0;
+	m_numInvalidCookiesDropped = 0;
+
+	m_perClientRateLimit = RateLimitConfig( DEFAULT_CLIENT_PACKETS_PER_SECOND, DEFAULT_CLIENT_BURST_SIZE );
+	m_perRelayRateLimit = makePerRelayRateLimit( m_perClientRateLimit );
+	m_perUnknownSourceRateLimit = RateLimitConfig( DEFAULT_UNKNOWN_SOURCE_PACKETS_PER_SECOND, DEFAULT_UNKNOWN_SOURCE_BURST_SIZE );
+	m_allUnknownSourcesRateLimit = RateLimitConfig( DEFAULT_ALL_UNKNOWN_SOURCES_PACKETS_PER_SECOND, DEFAULT_ALL_UNKNOWN_SOURCES_BURST_SIZE );
+	m_relayedJoinRateLimit = RateLimitConfig( RELAYED_JOINS_PER_SECOND, RELAYED_JOIN_BURST_SIZE );
+	m_numPacketsDroppedByClientRateLimit = 0;
+	m_numPacketsDroppedByUnknownSourceRateLimit = 0;
+
+	m_numSnapshotsForwarded = 0;
+	m_numStaleSnapshotsDropped = 0;
+
+	m_cookieGenerator.initializeSecret();
+}
+
+
+void SnapshotRelay::setRateLimits( const RateLimitConfig& perClientConfig, const RateLimitConfig& perUnknownSourceConfig, const RateLimitConfig& allUnknownSourcesConfig ) {
+
+	m_perClientRateLimit = perClientConfig;
+	m_perRelayRateLimit = makePerRelayRateLimit( m_perClientRateLimit );
+	m_perUnknownSourceRateLimit = perUnknownSourceConfig;
+	m_allUnknownSourcesRateLimit = allUnknownSourcesConfig;
+
+	printf( "Client rate limit: %.1f packets per second, burst of %.1f\n", m_perClientRateLimit.m_packetsPerSecond, m_perClientRateLimit.m_burstSize );
+	printf( "Unknown source rate limit: %.1f packets per second, burst of %.1f\n", m_perUnknownSourceRateLimit.m_packetsPerSecond, m_perUnknownSourceRateLimit.m_burstSize );
+	printf( "All unknown sources rate limit: %.1f packets per second, burst of %.1f\n", m_allUnknownSourcesRateLimit.m_packetsPerSecond, m_allUnknownSourcesRateLimit.m_burstSize );
+}
+
+
+void SnapshotRelay::initialize() {
+
+	printf( "\n\nAttempting to create UDP Relay with IP: %s and Port: %s for upstream IP: %s and Port: %s \n", m_IPAddress.c_str(), m_PortNumber.c_str(), m_upstreamIPAddress.c_str(), m_upstreamPortNumber.c_str() );
+
+	WSAData wsaData;
+	int winSockResult = 0;
+
+	struct addrinfo* result = nullptr;
+	struct addrinfo hints;
+
+	winSockResult = WSAStartup( MAKEWORD( 2, 2 ), &wsaData );
+	if ( winSockResult != 0 ) {
+
+		printf( "WSAStartup failed with error number: %d\n", winSockResult );
+		return;
+	}
+
+	ZeroMemory( &hints, sizeof( hints ) );
+	hints.ai_family		= AF_INET;
+	hints.ai_socktype	= SOCK_DGRAM;
+	hints.ai_protocol	= IPPROTO_UDP;
+
+	winSockResult = getaddrinfo( m_upstreamIPAddress.c_str(), m_upstreamPortNumber.c_str(), &hints, &result );
+	if ( winSockResult != 0 ) {
+
+		printf( "getaddrinfo for the upstream address failed with error number: %d\n", winSockResult );
+		WSACleanup();
+
+		return;
+	}
+
+	memcpy( &m_upstreamAddress, result->ai_addr, sizeof( m_upstreamAddress ) );
+	freeaddrinfo( result );
+	result = nullptr;
+
+	hints.ai_flags		= AI_PASSIVE;
+
+	winSockResult = getaddrinfo( m_IPAddress.c_str(), m_PortNumber.c_str(), &hints, &result );
+	if ( winSockResult != 0 ) {
+
+		printf( "getaddrinfo function call failed with error number: %d\n", winSockResult );
+		WSACleanup();
+
+		return;
+	}
+
+	m_listenSocket = socket( result->ai_family, result->ai_socktype, result->ai_protocol );
+	if ( m_listenSocket == INVALID_SOCKET ) {
+
+		printf( "socket function call failed with error number: %ld\n", WSAGetLastError() );
+
+		freeaddrinfo( result );
+		WSACleanup();
+		return;
+	}
+
+	winSockResult = bind( m_listenSocket, result->ai_addr, static_cast<int>( result->ai_addrlen ) );
+
+	if ( winSockResult == SOCKET_ERROR ) {
+
+		printf( "Bind to listenSocket failed with error number: %d\n", WSAGetLastError() );
+
+		freeaddrinfo( result );
+		closesocket( m_listenSocket );
+		m_listenSocket = INVALID_SOCKET;
+		WSACleanup();
+
+		return;
+	}
+
+	u_long iMode = 1; // 0 = blocking ... != 0 is non blocking
+	winSockResult = ioctlsocket( m_listenSocket, FIONBIO, &iMode );
+	if ( winSockResult != NO_ERROR ) {
+
+		printf( "ioctlsocket failed with error: %ld\n", winSockResult );
+	}
+
+	freeaddrinfo( result );
+
+	UDPServer::loadRelayAllowlist( RELAY_ALLOWLIST_FILE_PATH, m_relayAllowlist );
+}
+
+
+void SnapshotRelay::run() {
+
+	if ( m_listenSocket == INVALID_SOCKET ) {
+
+		printf( "UDP Relay failed to initialize, nothing to run\n\n" );
+		return;
+	}
+
+	m_relayShouldRun = true;
+	m_lastMaintenanceTimeSeconds = cbutil::getCurrentTimeSeconds();
+
+	while ( m_relayShouldRun ) {
+
+		// Sleeps until a socket is readable or maintenance is due, instead of spinning on empty sockets
+		if ( waitForPackets() ) {
+
+			// Any event counts, an error left unread would wake every poll straight away
+			if ( m_pollDescriptors[0].revents != 0 ) {
+
+				receiveFromDownstream();
+			}
+
+			// Sessions opened by receiveFromDownstream are not in the list yet and get polled next loop
+			for ( int i = 0; i < static_cast<int>( m_polledSessions.size() ); ++i ) {
+
+				if ( m_pollDescriptors[ i + 1 ].revents != 0 ) {
+
+					receiveFromUpstream( m_polledSessions[i] );
+				}
+			}
+		}
+
+		maintainSessions();
+		displayRelaySummary();
+	}
+
+	while ( !m_sessions.empty() ) {
+
+		closeSession( m_sessions.begin()->second );
+	}
+
+	closesocket( m_listenSocket );
+	WSACleanup();
+
+	printf( "UDP Relay has finished executing\n\n" );
+}
+
+
+bool SnapshotRelay::waitForPackets() {
+
+	m_pollDescriptors.clear();
+	m_polledSessions.clear();
+
+	WSAPOLLFD pollDescriptor;
+	pollDescriptor.fd = m_listenSocket;
+	pollDescriptor.events = POLLRDNORM;
+	pollDescriptor.revents = 0;
+	m_pollDescriptors.push_back( pollDescriptor );
+
+	std::map<int,RelaySession*>::iterator itSession;
+	for ( itSession = m_sessions.begin(); itSession != m_sessions.end(); ++itSession ) {
+
+		pollDescriptor.fd = itSession->second->m_upstreamSocket;
+		m_pollDescriptors.push_back( pollDescriptor );
+		m_polledSessions.push_back( itSession->second );
+	}
+
+	int numReadySockets = WSAPoll( &m_pollDescriptors[0], static_cast<ULONG>( m_pollDescriptors.size() ), RELAY_POLL_TIMEOUT_MILLISECONDS );
+	if ( numReadySockets == SOCKET_ERROR ) {
+
+		LOG_ERROR_RATE_LIMITED( LOG_MSG_RELAY_POLL_FAILED, WSAGetLastError() );
+
+		// Never spin on a persistent error
+		Sleep( 1 );
+		return false;
+	}
+
+	return numReadySockets > 0;
+}
+
+
+void SnapshotRelay::receiveFromDownstream() {
+
+	for ( int i = 0; i < MAX_PACKETS_RECEIVED_PER_LOOP; ++i ) {
+
+		sockaddr_in sourceAddress;
+		int sizeOfResultAddress = sizeof( sourceAddress );
+		int numBytesReceived = recvfrom( m_listenSocket, m_packetBuffer, sizeof( m_packetBuffer ), 0, (sockaddr*) &sourceAddress, &sizeOfResultAddress );
+
+		if ( numBytesReceived <= 0 ) {
+
+			break;
+		}
+
+		unsigned char packetID = static_cast<unsigned char>( m_packetBuffer[0] );
+		if ( !isDownstreamPacketID( packetID ) ) {
+
+			++m_numUnsolicitedPacketsDropped;
+			continue;
+		}
+
+		double currentTimeSeconds = cbutil::getCurrentTimeSeconds();
+
+		std::map<AddressKey,KnownSource>::iterator itSession;
+		itSession = m_sessionForAddress.find( makeAddressKey( sourceAddress ) );
+
+		if ( itSession == m_sessionForAddress.end() ) {
+
+			// Throttle before the packet is even parsed
+			if ( !m_unknownSourceRateLimiter.tryConsume( sourceAddress, m_perUnknownSourceRateLimit, m_allUnknownSourcesRateLimit, currentTimeSeconds ) ) {
+
+				++m_numPacketsDroppedByUnknownSourceRateLimit;
+				continue;
+			}
+
+			if ( numBytesReceived != sizeof( PlayerDataPacket ) ) {
+
+				++m_numUnsolicitedPacketsDropped;
+				continue;
+			}
+
+			PlayerDataPacket packet;
+			memcpy( &packet, m_packetBuffer, sizeof( packet ) );
+			handlePacketFromUnknownSource( sourceAddress, packet );
+			continue;
+		}
+
+		// Same split as the server front, a downstream relay's wrapped packets share one bucket sized for all its clients
+		KnownSource& knownSource = itSession->second;
+		TokenBucket& rateLimitBucket = ( packetID == RELAYED_PACKET_ID ) ? knownSource.m_relayedRateLimitBucket : knownSource.m_rateLimitBucket;
+
+		if ( !rateLimitBucket.tryConsume( ( packetID == RELAYED_PACKET_ID ) ? m_perRelayRateLimit : m_perClientRateLimit, currentTimeSeconds ) ) {
+
+			++m_numPacketsDroppedByClientRateLimit;
+			continue;
+		}
+
+		std::map<int,RelaySession*>::iterator itRelaySession;
+		itRelaySession = m_sessions.find( knownSource.m_sessionID );
+
+		if ( itRelaySession == m_sessions.end() ) {
+
+			m_sessionForAddress.erase( itSession );
+			continue;
+		}
+
+		handleDownstreamPacket( itRelaySession->second, knownSource, sourceAddress, m_packetBuffer, numBytesReceived );
+	}
+}
+
+
+void SnapshotRelay::receiveFromUpstream( RelaySession* session ) {
+
+	for ( int i = 0; i < MAX_PACKETS_RECEIVED_PER_LOOP; ++i ) {
+
+		sockaddr_in sourceAddress;
+		int sizeOfResultAddress = sizeof( sourceAddress );
+		int numBytesReceived = recvfrom( session->m_upstreamSocket, m_packetBuffer, sizeof( m_packetBuffer ), 0, (sockaddr*) &sourceAddress, &sizeOfResultAddress );
+
+		if ( numBytesReceived <= 0 ) {
+
+			break;
+		}
+
+		if ( !isSameAddress( sourceAddress, m_upstreamAddress ) ) {
+
+			++m_numUnsolicitedPacketsDropped;
+			continue;
+		}
+
+		unsigned char packetID = static_cast<unsigned char>( m_packetBuffer[0] );
+
+		if ( packetID == SNAPSHOT_PACKET_ID && numBytesReceived >= static_cast<int>( sizeof( SnapshotHeader ) ) ) {
+
+			SnapshotHeader header;
+			memcpy( &header, m_packetBuffer, sizeof( header ) );
+
+			if ( header.m_sessionID != session->m_sessionID ) {
+
+				++m_numStaleSnapshotsDropped;
+				continue;
+			}
+
+			// Snapshots only go to subscribers, so the first one means the upstream will take wrapped joins from us
+			if ( !session->m_isSubscribed ) {
+
+				session->m_isSubscribed = true;
+				sendPendingJoins( session );
+			}
+
+			if ( !session->m_snapshotCache.applySnapshot( m_packetBuffer, numBytesReceived ) ) {
+
+				++m_numStaleSnapshotsDropped;
+				continue;
+			}
+
+			session->m_lastUpstreamPacketTimeSeconds = cbutil::getCurrentTimeSeconds();
+			forwardSnapshot( session, m_packetBuffer, numBytesReceived );
+
+		} else if ( packetID == CONNECTION_CHALLENGE_ID && numBytesReceived == sizeof( PlayerDataPacket ) ) {
+
+			PlayerDataPacket challengePacket;
+			memcpy( &challengePacket, m_packetBuffer, sizeof( challengePacket ) );
+
+			session->m_upstreamCookie = static_cast<unsigned int>( challengePacket.m_packetAckID );
+			session->m_hasUpstreamCookie = true;
+			sendSubscribe( session, cbutil::getCurrentTimeSeconds() );
+
+		} else if ( packetID == RELAYED_PACKET_ID && numBytesReceived == sizeof( RelayedPacket ) ) {
+
+			RelayedPacket relayedPacket;
+			memcpy( &relayedPacket, m_packetBuffer, sizeof( relayedPacket ) );
+			routeRelayedPacketDownstream( session, relayedPacket );
+
+		} else {
+
+			++m_numUnsolicitedPacketsDropped;
+		}
+	}
+}
+
+
+void SnapshotRelay::handlePacketFromUnknownSource( const sockaddr_in& sourceAddress, const PlayerDataPacket& packet ) {
+
+	if ( packet.m_packetID == CONNECTION_REQUEST_ID ) {
+
+		// Same handshake as the server, the relay answers it with its own secret
+		PlayerDataPacket challengePacket;
+		challengePacket.m_packetID = CONNECTION_CHALLENGE_ID;
+		challengePacket.m_sessionID = packet.m_sessionID;
+		challengePacket.m_packetAckID = static_cast<int>( m_cookieGenerator.generateCookie( sourceAddress, cbutil::getCurrentTimeSeconds() ) );
+
+		sendDownstream( sourceAddress, (char*) &challengePacket, sizeof( challengePacket ) );
+		return;
+	}
+
+	if ( packet.m_packetID != CONNECTION_RESPONSE_ID && packet.m_packetID != RELAY_SUBSCRIBE_ID ) {
+
+		++m_numUnsolicitedPacketsDropped;
+		return;
+	}
+
+	unsigned int echoedCookie = static_cast<unsigned int>( packet.m_packetAckID );
+	if ( !m_cookieGenerator.isCookieValid( echoedCookie, sourceAddress, cbutil::getCurrentTimeSeconds() ) ) {
+
+		++m_numInvalidCookiesDropped;
+		return;
+	}
+
+	admitDownstream( sourceAddress, packet );
+}
+
+
+void SnapshotRelay::admitDownstream( const sockaddr_in& sourceAddress, const PlayerDataPacket& packet ) {
+
+	RelaySession* session = findOrCreateSession( packet.m_sessionID );
+	if ( session == nullptr ) {
+
+		return;
+	}
+
+	if ( static_cast<int>( session->m_downstream.size() ) >= MAX_DOWNSTREAM_PER_SESSION ) {
+
+		LOG_WARNING( LOG_MSG_ROOM_FULL, sourceAddress, session->m_sessionID );
+		return;
+	}
+
+	RelayDownstream downstream;
+	downstream.m_address = sourceAddress;
+	downstream.m_timeStampSecondsForLastPacketReceived = cbutil::getCurrentTimeSeconds();
+	downstream.m_isRelay = ( packet.m_packetID == RELAY_SUBSCRIBE_ID );
+	downstream.m_joinRateLimitBucket.reset();
+
+	KnownSource knownSource;
+	knownSource.m_sessionID = session->m_sessionID;
+	knownSource.m_rateLimitBucket.reset();
+	knownSource.m_relayedRateLimitBucket.reset();
+	knownSource.m_isAllowedToRelay = downstream.m_isRelay && m_relayAllowlist.find( sourceAddress.sin_addr.s_addr ) != m_relayAllowlist.end();
+
+	AddressKey sourceKey = makeAddressKey( sourceAddress );
+	session->m_downstream.insert( std::pair<AddressKey,RelayDownstream>( sourceKey, downstream ) );
+	m_sessionForAddress.insert( std::pair<AddressKey,KnownSource>( sourceKey, knownSource ) );
+
+	LOG_INFO( LOG_MSG_RELAY_DOWNSTREAM_JOINED, sourceAddress, session->m_sessionID );
+
+	// Newcomers start from the cache instead of waiting for the next full snapshot
+	sendCachedSnapshot( session, sourceAddress );
+
+	if ( !downstream.m_isRelay ) {
+
+		// The upstream room creates the player and answers through us with NEW_PLAYER_ACK_ID
+		RelayedPacket relayedPacket;
+		relayedPacket.m_clientAddress = sourceAddress.sin_addr.s_addr;
+		relayedPacket.m_clientPort = sourceAddress.sin_port;
+		relayedPacket.m_packet = packet;
+		forwardUpstream( session, relayedPacket );
+	}
+}
+
+
+void SnapshotRelay::handleDownstreamPacket( RelaySession* session, const KnownSource& knownSource, const sockaddr_in& sourceAddress, const char* packetBuffer, int numBytesReceived ) {
+
+	AddressKey sourceKey = makeAddressKey( sourceAddress );
+
+	std::map<AddressKey,RelayDownstream>::iterator itDownstream;
+	itDownstream = session->m_downstream.find( sourceKey );
+
+	if ( itDownstream == session->m_downstream.end() ) {
+
+		++m_numUnsolicitedPacketsDropped;
+		return;
+	}
+
+	RelayDownstream& downstream = itDownstream->second;
+	double currentTimeSeconds = cbutil::getCurrentTimeSeconds();
+	unsigned char packetID = static_cast<unsigned char>( packetBuffer[0] );
+
+	if ( packetID == RELAYED_PACKET_ID ) {
+
+		// Already wrapped by a relay further down, pass it on untouched and remember the way back
+		RelayedPacket relayedPacket;
+		if ( !knownSource.m_isAllowedToRelay || numBytesReceived != sizeof( relayedPacket ) ) {
+
+			++m_numUnsolicitedPacketsDropped;
+			return;
+		}
+
+		memcpy( &relayedPacket, packetBuffer, sizeof( relayedPacket ) );
+		if ( relayedPacket.m_packet.m_sessionID != session->m_sessionID ) {
+
+			++m_numUnsolicitedPacketsDropped;
+			return;
+		}
+
+		downstream.m_timeStampSecondsForLastPacketReceived = currentTimeSeconds;
+
+		sockaddr_in clientAddress;
+		ZeroMemory( &clientAddress, sizeof( clientAddress ) );
+		clientAddress.sin_family = AF_INET;
+		clientAddress.sin_addr.s_addr = relayedPacket.m_clientAddress;
+		clientAddress.sin_port = relayedPacket.m_clientPort;
+		AddressKey clientKey = makeAddressKey( clientAddress );
+
+		// Our own players are ours alone, a downstream relay may not speak for them either
+		if ( session->m_downstream.find( clientKey ) != session->m_downstream.end() ) {
+
+			LOG_ERROR_RATE_LIMITED( LOG_MSG_RELAY_ROUTE_CONFLICT, downstream.m_address, clientAddress );
+			++m_numUnsolicitedPacketsDropped;
+			return;
+		}
+
+		std::map<AddressKey,RelayRoute>::iterator itRoute;
+		itRoute = session->m_routeForRelayedClient.find( clientKey );
+
+		if ( itRoute != session->m_routeForRelayedClient.end() && itRoute->second.m_nextHopKey != sourceKey ) {
+
+			// A live route is never handed to another relay, or any relay could steal a client's replies
+			bool hasRouteExpired = currentTimeSeconds - itRoute->second.m_timeStampSecondsForLastPacketReceived > DURATION_THRESHOLD_FOR_DISCONECT
+				|| session->m_downstream.find( itRoute->second.m_nextHopKey ) == session->m_downstream.end();
+
+			if ( !hasRouteExpired ) {
+
+				LOG_ERROR_RATE_LIMITED( LOG_MSG_RELAY_ROUTE_CONFLICT, downstream.m_address, clientAddress );
+				++m_numUnsolicitedPacketsDropped;
+				return;
+			}
+
+			session->m_routeForRelayedClient.erase( itRoute );
+			itRoute = session->m_routeForRelayedClient.end();
+		}
+
+		if ( itRoute == session->m_routeForRelayedClient.end() ) {
+
+			if ( !tryAddRoute( session, downstream, sourceKey, clientKey, currentTimeSeconds ) ) {
+
+				++m_numUnsolicitedPacketsDropped;
+				return;
+			}
+
+		} else {
+
+			itRoute->second.m_timeStampSecondsForLastPacketReceived = currentTimeSeconds;
+		}
+
+		forwardUpstream( session, relayedPacket );
+		return;
+	}
+
+	if ( numBytesReceived != sizeof( PlayerDataPacket ) ) {
+
+		++m_numUnsolicitedPacketsDropped;
+		return;
+	}
+
+	PlayerDataPacket packet;
+	memcpy( &packet, packetBuffer, sizeof( packet ) );
+
+	if ( packet.m_sessionID != session->m_sessionID ) {
+
+		++m_numUnsolicitedPacketsDropped;
+		return;
+	}
+
+	if ( packetID == RELAY_SUBSCRIBE_ID ) {
+
+		// Keep alive from a downstream relay or spectator
+		if ( downstream.m_isRelay ) {
+
+			downstream.m_timeStampSecondsForLastPacketReceived = currentTimeSeconds;
+		}
+
+		return;
+	}
+
+	if ( packetID == CONNECTION_REQUEST_ID || downstream.m_isRelay ) {
+
+		// Already admitted, and subscribers only ever speak wrapped
+		return;
+	}
+
+	downstream.m_timeStampSecondsForLastPacketReceived = currentTimeSeconds;
+
+	RelayedPacket relayedPacket;
+	relayedPacket.m_clientAddress = downstream.m_address.sin_addr.s_addr;
+	relayedPacket.m_clientPort = downstream.m_address.sin_port;
+	relayedPacket.m_packet = packet;
+	forwardUpstream( session, relayedPacket );
+}
+
+
+bool SnapshotRelay::tryAddRoute( RelaySession* session, RelayDownstream& downstream, AddressKey nextHopKey, AddressKey clientKey, double currentTimeSeconds ) {
+
+	// Same bounds the server puts on us, so one downstream relay cannot claim every client in a room
+	int numRoutesThroughNextHop = 0;
+
+	std::map<AddressKey,RelayRoute>::const_iterator itRoute;
+	for ( itRoute = session->m_routeForRelayedClient.begin(); itRoute != session->m_routeForRelayedClient.end(); ++itRoute ) {
+
+		if ( itRoute->second.m_nextHopKey == nextHopKey ) {
+
+			++numRoutesThroughNextHop;
+		}
+	}
+
+	if ( numRoutesThroughNextHop >= MAX_CLIENTS_PER_RELAY ) {
+
+		return false;
+	}
+
+	if ( !downstream.m_joinRateLimitBucket.tryConsume( m_relayedJoinRateLimit, currentTimeSeconds ) ) {
+
+		return false;
+	}
+
+	RelayRoute route;
+	route.m_nextHopKey = nextHopKey;
+	route.m_timeStampSecondsForLastPacketReceived = currentTimeSeconds;
+	session->m_routeForRelayedClient.insert( std::pair<AddressKey,RelayRoute>( clientKey, route ) );
+
+	return true;
+}
+
+
+void SnapshotRelay::forwardUpstream( RelaySession* session, const RelayedPacket& relayedPacket ) {
+
+	if ( session->m_isSubscribed ) {
+
+		sendUpstream( session, (const char*) &relayedPacket, sizeof( relayedPacket ) );
+		return;
+	}
+
+	// The upstream drops everything from a socket it has not seen subscribe. Joins wait for that,
+	// anything else would be lost upstream anyway and the client resends it.
+	if ( relayedPacket.m_packet.m_packetID != CONNECTION_RESPONSE_ID ) {
+
+		return;
+	}
+
+	for ( int i = 0; i < static_cast<int>( session->m_pendingJoins.size() ); ++i ) {
+
+		RelayedPacket& pendingJoin = session->m_pendingJoins[i];
+		if ( pendingJoin.m_clientAddress == relayedPacket.m_clientAddress && pendingJoin.m_clientPort == relayedPacket.m_clientPort ) {
+
+			// A retry, keep only the latest copy
+			pendingJoin = relayedPacket;
+			return;
+		}
+	}
+
+	if ( static_cast<int>( session->m_pendingJoins.size() ) < MAX_DOWNSTREAM_PER_SESSION ) {
+
+		session->m_pendingJoins.push_back( relayedPacket );
+	}
+}
+
+
+void SnapshotRelay::sendPendingJoins( RelaySession* session ) {
+
+	for ( int i = 0; i < static_cast<int>( session->m_pendingJoins.size() ); ++i ) {
+
+		const RelayedPacket& pendingJoin = session->m_pendingJoins[i];
+
+		sockaddr_in clientAddress;
+		ZeroMemory( &clientAddress, sizeof( clientAddress ) );
+		clientAddress.sin_family = AF_INET;
+		clientAddress.sin_addr.s_addr = pendingJoin.m_clientAddress;
+		clientAddress.sin_port = pendingJoin.m_clientPort;
+		AddressKey clientKey = makeAddressKey( clientAddress );
+
+		// Skip anyone who timed out while we waited, the upstream would only create a player to expire
+		if ( session->m_downstream.find( clientKey ) == session->m_downstream.end()
+			&& session->m_routeForRelayedClient.find( clientKey ) == session->m_routeForRelayedClient.end() ) {
+
+			continue;
+		}
+
+		sendUpstream( session, (const char*) &pendingJoin, sizeof( pendingJoin ) );
+	}
+
+	session->m_pendingJoins.clear();
+}
+
+
+void SnapshotRelay::forwardSnapshot( RelaySession* session, const char* packetBuffer, int packetSize ) {
+
+	std::map<AddressKey,RelayDownstream>::iterator itDownstream;
+	for ( itDownstream = session->m_downstream.begin(); itDownstream != session->m_downstream.end(); ++itDownstream ) {
+
+		sendDownstream( itDownstream->second.m_address, packetBuffer, packetSize );
+		++m_numSnapshotsForwarded;
+	}
+}
+
+
+void SnapshotRelay::routeRelayedPacketDownstream( RelaySession* session, const RelayedPacket& relayedPacket ) {
+
+	sockaddr_in clientAddress;
+	ZeroMemory( &clientAddress, sizeof( clientAddress ) );
+	clientAddress.sin_family = AF_INET;
+	clientAddress.sin_addr.s_addr = relayedPacket.m_clientAddress;
+	clientAddress.sin_port = relayedPacket.m_clientPort;
+	AddressKey clientKey = makeAddressKey( clientAddress );
+
+	// Our own player gets the bare packet
+	std::map<AddressKey,RelayDownstream>::iterator itDownstream;
+	itDownstream = session->m_downstream.find( clientKey );
+
+	if ( itDownstream != session->m_downstream.end() && !itDownstream->second.m_isRelay ) {
+
+		sendDownstream( clientAddress, (char*) &relayedPacket.m_packet, sizeof( relayedPacket.m_packet ) );
+		return;
+	}
+
+	// Otherwise it belongs to a player behind one of our downstream relays
+	std::map<AddressKey,RelayRoute>::iterator itRoute;
+	itRoute = session->m_routeForRelayedClient.find( clientKey );
+
+	if ( itRoute == session->m_routeForRelayedClient.end() ) {
+
+		++m_numUnsolicitedPacketsDropped;
+		return;
+	}
+
+	itDownstream = session->m_downstream.find( itRoute->second.m_nextHopKey );
+	if ( itDownstream == session->m_downstream.end() ) {
+
+		session->m_routeForRelayedClient.erase( itRoute );
+		++m_numUnsolicitedPacketsDropped;
+		return;
+	}
+
+	sendDownstream( itDownstream->second.m_address, (const char*) &relayedPacket, sizeof( relayedPacket ) );
+}
+
+
+void SnapshotRelay::sendCachedSnapshot( RelaySession* session, const sockaddr_in& destinationAddress ) {
+
+	char snapshotBuffer[ MAX_SNAPSHOT_PACKET_SIZE ];
+
+	int snapshotSize = session->m_snapshotCache.buildFullSnapshot( snapshotBuffer );
+	if ( snapshotSize > 0 ) {
+
+		sendDownstream( destinationAddress, snapshotBuffer, snapshotSize );
+	}
+}
+
+
+void SnapshotRelay::sendUpstream( RelaySession* session, const char* packetBuffer, int packetSize ) {
+
+	int winSockSendResult = 0;
+	winSockSendResult = sendto( session->m_upstreamSocket, packetBuffer, packetSize, 0, (sockaddr*) &m_upstreamAddress, sizeof( m_upstreamAddress ) );
+
+	if ( winSockSendResult == SOCKET_ERROR ) {
+
+		LOG_ERROR_RATE_LIMITED( LOG_MSG_SEND_FAILED, WSAGetLastError() );
+	}
+}
+
+
+void SnapshotRelay::sendDownstream( const sockaddr_in& destinationAddress, const char* packetBuffer, int packetSize ) {
+
+	int winSockSendResult = 0;
+	winSockSendResult = sendto( m_listenSocket, packetBuffer, packetSize, 0, (sockaddr*) &destinationAddress, sizeof( destinationAddress ) );
+
+	if ( winSockSendResult == SOCKET_ERROR ) {
+
+		LOG_ERROR_RATE_LIMITED( LOG_MSG_SEND_FAILED, WSAGetLastError() );
+	}
+}
+
+
+void SnapshotRelay::sendSubscribe( RelaySession* session, double currentTimeSeconds ) {
+
+	// Before a cookie this starts the handshake, after it the same packet doubles as the keep alive
+	PlayerDataPacket subscribePacket;
+	subscribePacket.m_sessionID = session->m_sessionID;
+
+	if ( session->m_hasUpstreamCookie ) {
+
+		subscribePacket.m_packetID = RELAY_SUBSCRIBE_ID;
+		subscribePacket.m_packetAckID = static_cast<int>( session->m_upstreamCookie );
+
+	} else {
+
+		subscribePacket.m_packetID = CONNECTION_REQUEST_ID;
+	}
+
+	sendUpstream( session, (char*) &subscribePacket, sizeof( subscribePacket ) );
+	session->m_lastSubscribeSentTimeSeconds = currentTimeSeconds;
+}
+
+
+RelaySession* SnapshotRelay::findOrCreateSession( int sessionID ) {
+
+	std::map<int,RelaySession*>::iterator itSession;
+	itSession = m_sessions.find( sessionID );
+
+	if ( itSession != m_sessions.end() ) {
+
+		return itSession->second;
+	}
+
+	if ( static_cast<int>( m_sessions.size() ) >= MAX_RELAY_SESSIONS ) {
+
+		LOG_ERROR_RATE_LIMITED( LOG_MSG_ROOM_LIMIT_REACHED, static_cast<unsigned int>( MAX_RELAY_SESSIONS ), sessionID );
+		return nullptr;
+	}
+
+	SOCKET upstreamSocket = socket( AF_INET, SOCK_DGRAM, IPPROTO_UDP );
+	if ( upstreamSocket == INVALID_SOCKET ) {
+
+		LOG_ERROR_RATE_LIMITED( LOG_MSG_SEND_FAILED, WSAGetLastError() );
+		return nullptr;
+	}
+
+	// Any free port, the upstream learns it from our first packet
+	sockaddr_in localAddress;
+	ZeroMemory( &localAddress, sizeof( localAddress ) );
+	localAddress.sin_family = AF_INET;
+	localAddress.sin_addr.s_addr = htonl( INADDR_ANY );
+	localAddress.sin_port = 0;
+
+	if ( bind( upstreamSocket, (sockaddr*) &localAddress, sizeof( localAddress ) ) == SOCKET_ERROR ) {
+
+		LOG_ERROR_RATE_LIMITED( LOG_MSG_SEND_FAILED, WSAGetLastError() );
+		closesocket( upstreamSocket );
+		return nullptr;
+	}
+
+	u_long iMode = 1; // 0 = blocking ... != 0 is non blocking
+	ioctlsocket( upstreamSocket, FIONBIO, &iMode );
+
+	double currentTimeSeconds = cbutil::getCurrentTimeSeconds();
+
+	RelaySession* session = new RelaySession;
+	session->m_sessionID = sessionID;
+	session->m_upstreamSocket = upstreamSocket;
+	session->m_upstreamCookie = 0;
+	session->m_hasUpstreamCookie = false;
+	session->m_isSubscribed = false;
+	session->m_lastSubscribeSentTimeSeconds = 0.0;
+	session->m_lastUpstreamPacketTimeSeconds = currentTimeSeconds;
+	m_sessions.insert( std::pair<int,RelaySession*>( sessionID, session ) );
+
+	LOG_INFO( LOG_MSG_RELAY_SESSION_OPENED, sessionID, m_upstreamAddress );
+
+	sendSubscribe( session, currentTimeSeconds );
+
+	return session;
+}
+
+
+void SnapshotRelay::closeSession( RelaySession* session ) {
+
+	std::map<AddressKey,RelayDownstream>::iterator itDownstream;
+	for ( itDownstream = session->m_downstream.begin(); itDownstream != session->m_downstream.end(); ++itDownstream ) {
+
+		m_sessionForAddress.erase( itDownstream->first );
+	}
+
+	// Upstream drops our subscription once the keep alives stop
+	closesocket( session->m_upstreamSocket );
+	m_sessions.erase( session->m_sessionID );
+	delete session;
+}
+
+
+void SnapshotRelay::maintainSessions() {
+
+	double currentTimeSeconds = cbutil::getCurrentTimeSeconds();
+	if ( currentTimeSeconds - m_lastMaintenanceTimeSeconds < RELAY_MAINTENANCE_INTERVAL_SECONDS ) {
+
+		return;
+	}
+
+	m_durationSinceLastSummary += currentTimeSeconds - m_lastMaintenanceTimeSeconds;
+	m_lastMaintenanceTimeSeconds = currentTimeSeconds;
+
+	std::vector<RelaySession*> sessionsToClose;
+
+	std::map<int,RelaySession*>::iterator itSession;
+	for ( itSession = m_sessions.begin(); itSession != m_sessions.end(); ++itSession ) {
+
+		RelaySession* session = itSession->second;
+		expireDownstream( session, currentTimeSeconds );
+
+		if ( session->m_downstream.empty() ) {
+
+			sessionsToClose.push_back( session );
+			continue;
+		}
+
+		if ( session->m_hasUpstreamCookie && currentTimeSeconds - session->m_lastUpstreamPacketTimeSeconds > DURATION_THRESHOLD_FOR_DISCONECT ) {
+
+			// Upstream forgot us ( restarted, or expired us while packets were lost )
+			LOG_WARNING( LOG_MSG_RELAY_UPSTREAM_LOST, session->m_sessionID );
+			session->m_hasUpstreamCookie = false;
+			session->m_isSubscribed = false;
+			session->m_lastUpstreamPacketTimeSeconds = currentTimeSeconds;
+			sendSubscribe( session, currentTimeSeconds );
+
+		} else if ( currentTimeSeconds - session->m_lastSubscribeSentTimeSeconds >= RELAY_SUBSCRIBE_INTERVAL_SECONDS ) {
+
+			sendSubscribe( session, currentTimeSeconds );
+		}
+	}
+
+	for ( int i = 0; i < static_cast<int>( sessionsToClose.size() ); ++i ) {
+
+		LOG_INFO( LOG_MSG_RELAY_SESSION_CLOSED, sessionsToClose[i]->m_sessionID );
+		closeSession( sessionsToClose[i] );
+	}
+}
+
+
+void SnapshotRelay::expireDownstream( RelaySession* session, double currentTimeSeconds ) {
+
+	std::vector<AddressKey> downstreamToRemove;
+
+	std::map<AddressKey,RelayDownstream>::iterator itDownstream;
+	for ( itDownstream = session->m_downstream.begin(); itDownstream != session->m_downstream.end(); ++itDownstream ) {
+
+		const RelayDownstream& downstream = itDownstream->second;
+		if ( currentTimeSeconds - downstream.m_timeStampSecondsForLastPacketReceived > DURATION_THRESHOLD_FOR_DISCONECT ) {
+
+			LOG_INFO( downstream.m_isRelay ? LOG_MSG_RELAY_REMOVED_INACTIVE : LOG_MSG_CLIENT_REMOVED_INACTIVE, downstream.m_address );
+			downstreamToRemove.push_back( itDownstream->first );
+			m_sessionForAddress.erase( itDownstream->first );
+		}
+	}
+
+	for ( int i = 0; i < static_cast<int>( downstreamToRemove.size() ); ++i ) {
+
+		session->m_downstream.erase( downstreamToRemove[i] );
+	}
+
+	// Routes go with their relay, or once the player behind it has gone quiet
+	std::map<AddressKey,RelayRoute>::iterator itRoute = session->m_routeForRelayedClient.begin();
+	while ( itRoute != session->m_routeForRelayedClient.end() ) {
+
+		const RelayRoute& route = itRoute->second;
+		if ( currentTimeSeconds - route.m_timeStampSecondsForLastPacketReceived > DURATION_THRESHOLD_FOR_DISCONECT
+			|| session->m_downstream.find( route.m_nextHopKey ) == session->m_downstream.end() ) {
+
+			session->m_routeForRelayedClient.erase( itRoute++ );
+
+		} else {
+
+			++itRoute;
+		}
+	}
+}
+
+
+void SnapshotRelay::displayRelaySummary() {
+
+	if ( m_durationSinceLastSummary <= TIME_DIF_SECONDS_FOR_USER_DISPLAY ) {
+
+		return;
+	}
+
+	m_durationSinceLastSummary = 0.0;
+
+	LOG_INFO( LOG_MSG_RELAY_SUMMARY, static_cast<unsigned int>( m_sessions.size() ), static_cast<unsigned int>( m_sessionForAddress.size() ), m_numSnapshotsForwarded, m_numStaleSnapshotsDropped );
+	LOG_INFO( LOG_MSG_DROPPED_PACKET_TOTALS, m_numUnsolicitedPacketsDropped, m_numInvalidCookiesDropped );
+	LOG_INFO( LOG_MSG_RATE_LIMITED_TOTALS, m_numPacketsDroppedByClientRateLimit, m_numPacketsDroppedByUnknownSourceRateLimit );
+}
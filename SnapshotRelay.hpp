@@ -0,0 +1,144 @@
+#ifndef included_SnapshotRelay
+#define included_SnapshotRelay
+#pragma once
+
+#include <string>
+#include <map>
+#include <set>
+#include <vector>
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "Ws2_32.lib")
+
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include "UDPServer.hpp"
+#include "HandshakeCookie.hpp"
+#include "RateLimiter.hpp"
+#include "Snapshot.hpp"
+
+const double RELAY_SUBSCRIBE_INTERVAL_SECONDS = 1.0; // Keep alive, and handshake retry while unsubscribed
+const double RELAY_MAINTENANCE_INTERVAL_SECONDS = 0.1;
+const int	 RELAY_POLL_TIMEOUT_MILLISECONDS = static_cast<int>( RELAY_MAINTENANCE_INTERVAL_SECONDS * 1000.0 ); // Idle wakeups only for maintenance
+const int	 MAX_RELAY_SESSIONS = MAX_ROOMS;
+const int	 MAX_RELAY_PACKET_SIZE = MAX_SNAPSHOT_PACKET_SIZE; // Largest of a snapshot and a RelayedPacket
+
+// A player or a further relay receiving one room through us
+struct RelayDownstream {
+	sockaddr_in											m_address;
+	double												m_timeStampSecondsForLastPacketReceived;
+	bool												m_isRelay; // Subscribed rather than joined, only ever speaks wrapped
+	TokenBucket											m_joinRateLimitBucket; // New clients a downstream relay may route through us
+};
+
+// Which downstream relay a client further down the chain sits behind
+struct RelayRoute {
+	AddressKey											m_nextHopKey;
+	double												m_timeStampSecondsForLastPacketReceived;
+};
+
+// One upstream room. Each gets its own upstream socket because the upstream
+// ties a source address to a single room.
+struct RelaySession {
+	int													m_sessionID;
+	SOCKET												m_upstreamSocket;
+	unsigned int										m_upstreamCookie;
+	bool												m_hasUpstreamCookie;
+	bool												m_isSubscribed; // A snapshot arrived since the last handshake, so the upstream knows our socket
+	double												m_lastSubscribeSentTimeSeconds;
+	double												m_lastUpstreamPacketTimeSeconds;
+	SnapshotCache										m_snapshotCache;
+	std::map<AddressKey,RelayDownstream>				m_downstream;
+	std::map<AddressKey,RelayRoute>						m_routeForRelayedClient; // Client address = Key
+	std::vector<RelayedPacket>							m_pendingJoins; // Wrapped joins held until m_isSubscribed
+};
+
+// Relay mode of the server binary. Subscribes to an upstream server ( or
+// another relay ) once per room, caches the room's snapshot stream and fans
+// each snapshot out to its own downstream clients. Client packets go upstream
+// wrapped with the client's address, so the upstream still simulates and
+// rate limits every player itself. Downstream relays subscribe exactly like
+// this relay subscribes upstream, which is what makes relays chainable.
+class SnapshotRelay {
+public:
+	~SnapshotRelay();
+	explicit SnapshotRelay( const std::string& ipAddress, const std::string& portNumber, const std::string& upstreamIPAddress, const std::string& upstreamPortNumber );
+
+	void setRateLimits( const RateLimitConfig& perClientConfig, const RateLimitConfig& perUnknownSourceConfig, const RateLimitConfig& allUnknownSourcesConfig );
+
+	void initialize();
+	void run();
+
+protected:
+
+	SOCKET												m_listenSocket;
+
+	std::string											m_IPAddress;
+	std::string											m_PortNumber;
+	std::string											m_upstreamIPAddress;
+	std::string											m_upstreamPortNumber;
+	sockaddr_in											m_upstreamAddress;
+
+	bool												m_relayShouldRun;
+
+	std::map<int,RelaySession*>							m_sessions; // Session ID = Key
+	std::map<AddressKey,KnownSource>					m_sessionForAddress; // Holds each downstream's rate limits
+	std::set<u_long>									m_relayAllowlist; // Network order
+
+	double												m_lastMaintenanceTimeSeconds;
+	double												m_durationSinceLastSummary;
+	char												m_packetBuffer[ MAX_RELAY_PACKET_SIZE ];
+
+	// Rebuilt every loop, entry 0 is the listen socket and entry i + 1 belongs to m_polledSessions[i]
+	std::vector<WSAPOLLFD>								m_pollDescriptors;
+	std::vector<RelaySession*>							m_polledSessions;
+
+	// Handshake
+	HandshakeCookieGenerator							m_cookieGenerator;
+	unsigned int										m_numUnsolicitedPacketsDropped;
+	unsigned int										m_numInvalidCookiesDropped;
+
+	// Rate Limiting
+	RateLimitConfig										m_perClientRateLimit;
+	RateLimitConfig										m_perRelayRateLimit;
+	RateLimitConfig										m_perUnknownSourceRateLimit;
+	RateLimitConfig										m_allUnknownSourcesRateLimit;
+	RateLimitConfig										m_relayedJoinRateLimit;
+	UnknownSourceRateLimiter							m_unknownSourceRateLimiter;
+	unsigned int										m_numPacketsDroppedByClientRateLimit;
+	unsigned int										m_numPacketsDroppedByUnknownSourceRateLimit;
+
+	unsigned int										m_numSnapshotsForwarded;
+	unsigned int										m_numStaleSnapshotsDropped;
+
+private:
+
+	bool waitForPackets();
+	void receiveFromDownstream();
+	void receiveFromUpstream( RelaySession* session );
+
+	void handlePacketFromUnknownSource( const sockaddr_in& sourceAddress, const PlayerDataPacket& packet );
+	void handleDownstreamPacket( RelaySession* session, const KnownSource& knownSource, const sockaddr_in& sourceAddress, const char* packetBuffer, int numBytesReceived );
+	void admitDownstream( const sockaddr_in& sourceAddress, const PlayerDataPacket& packet );
+
+	bool tryAddRoute( RelaySession* session, RelayDownstream& downstream, AddressKey nextHopKey, AddressKey clientKey, double currentTimeSeconds );
+	void forwardUpstream( RelaySession* session, const RelayedPacket& relayedPacket );
+	void sendPendingJoins( RelaySession* session );
+	void forwardSnapshot( RelaySession* session, const char* packetBuffer, int packetSize );
+	void routeRelayedPacketDownstream( RelaySession* session, const RelayedPacket& relayedPacket );
+	void sendCachedSnapshot( RelaySession* session, const sockaddr_in& destinationAddress );
+	void sendUpstream( RelaySession* session, const char* packetBuffer, int packetSize );
+	void sendDownstream( const sockaddr_in& destinationAddress, const char* packetBuffer, int packetSize );
+	void sendSubscribe( RelaySession* session, double currentTimeSeconds );
+
+	RelaySession* findOrCreateSession( int sessionID );
+	void closeSession( RelaySession* session );
+	void maintainSessions();
+	void expireDownstream( RelaySession* session, double currentTimeSeconds );
+	void displayRelaySummary();
+};
+
+#endif
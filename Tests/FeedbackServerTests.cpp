@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "../HandshakeCookie.hpp"
+#include "../RateLimiter.hpp"
+#include "../WorldState.hpp"
+#include "../Snapshot.hpp"
+
+// Console checks for the pieces of the server that run without a socket.
+// Returns nonzero when any check fails so it can gate a build step.
+
+namespace {
+
+	int g_numChecks = 0;
+	int g_numFailedChecks = 0;
+}
+
+#define CHECK( condition ) \
+	do { \
+		++g_numChecks; \
+		if ( !( condition ) ) { \
+			++g_numFailedChecks; \
+			printf( "%s(%d): check failed: %s\n", __FILE__, __LINE__, #condition ); \
+		} \
+	} while ( 0 )
+
+
+namespace {
+
+	sockaddr_in makeAddress( u_long hostOrderAddress, u_short hostOrderPort ) {
+
+		sockaddr_in address;
+		memset( &address, 0, sizeof( address ) );
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl( hostOrderAddress );
+		address.sin_port = htons( hostOrderPort );
+
+		return address;
+	}
+
+
+	void testSipHashReferenceVector() {
+
+		// Key bytes 00..0f and message bytes 00..07, the 8 byte entry of the reference vectors
+		const uint64_t key[2] = { 0x0706050403020100ULL, 0x0f0e0d0c0b0a0908ULL };
+		CHECK( sipHashSingleWord( key, 0x0706050403020100ULL ) == 0x93f5f5799a932462ULL );
+	}
+
+
+	void testHandshakeCookieEpochs() {
+
+		HandshakeCookieGenerator cookieGenerator;
+		cookieGenerator.initializeSecret();
+
+		sockaddr_in clientAddress = makeAddress( 0x0a000001, 4000 );
+		double mintTimeSeconds = 100.0 * COOKIE_EPOCH_DURATION_SECONDS;
+		unsigned int cookie = cookieGenerator.generateCookie( clientAddress, mintTimeSeconds );
+
+		CHECK( cookieGenerator.isCookieValid( cookie, clientAddress, mintTimeSeconds ) );
+		CHECK( cookieGenerator.isCookieValid( cookie, clientAddress, mintTimeSeconds + COOKIE_EPOCH_DURATION_SECONDS ) );
+		CHECK( !cookieGenerator.isCookieValid( cookie, clientAddress, mintTimeSeconds + 2.0 * COOKIE_EPOCH_DURATION_SECONDS ) );
+
+		// Bound to the exact address and port
+		CHECK( !cookieGenerator.isCookieValid( cookie, makeAddress( 0x0a000001, 4001 ), mintTimeSeconds ) );
+		CHECK( !cookieGenerator.isCookieValid( cookie, makeAddress( 0x0a000002, 4000 ), mintTimeSeconds ) );
+	}
+
+
+	void testTokenBucketBurstAndRefill() {
+
+		RateLimitConfig config( 10.0f, 3.0f );
+		TokenBucket bucket;
+		bucket.reset();
+
+		// Starts full, so exactly the burst goes through at once
+		double currentTimeSeconds = 1000.0;
+		CHECK( bucket.tryConsume( config, currentTimeSeconds ) );
+		CHECK( bucket.tryConsume( config, currentTimeSeconds ) );
+		CHECK( bucket.tryConsume( config, currentTimeSeconds ) );
+		CHECK( !bucket.tryConsume( config, currentTimeSeconds ) );
+
+		// 150 ms at 10 per second is one and a half tokens
+		currentTimeSeconds += 0.15;
+		CHECK( bucket.tryConsume( config, currentTimeSeconds ) );
+		CHECK( !bucket.tryConsume( config, currentTimeSeconds ) );
+
+		// A long idle stretch refills no further than the burst
+		currentTimeSeconds += 60.0;
+		CHECK( bucket.tryConsume( config, currentTimeSeconds ) );
+		CHECK( bucket.tryConsume( config, currentTimeSeconds ) );
+		CHECK( bucket.tryConsume( config, currentTimeSeconds ) );
+		CHECK( !bucket.tryConsume( config, currentTimeSeconds ) );
+	}
+
+
+	void testWorldStateSwapRemove() {
+
+		WorldState worldState;
+		CHECK( worldState.addPlayer( 1, 10.0f, 0.0f, 0.0 ) == 0 );
+		CHECK( worldState.addPlayer( 2, 20.0f, 0.0f, 0.0 ) == 1 );
+		CHECK( worldState.addPlayer( 3, 30.0f, 0.0f, 0.0 ) == 2 );
+
+		// The last player fills the hole and the caller is told which slot moved
+		CHECK( worldState.removePlayer( 0 ) == 2 );
+		CHECK( worldState.getNumPlayers() == 2 );
+		CHECK( worldState.m_playerID[0] == 3 );
+		CHECK( worldState.m_positionX[0] == 30.0f );
+		CHECK( worldState.m_playerID[1] == 2 );
+
+		// The vacated tail is zeroed for the padded SIMD lanes
+		CHECK( worldState.m_playerID[2] == 0 );
+		CHECK( worldState.m_positionX[2] == 0.0f );
+
+		// Removing the last slot moves nobody
+		CHECK( worldState.removePlayer( 1 ) == INVALID_WORLD_STATE_INDEX );
+		CHECK( worldState.getNumPlayers() == 1 );
+		CHECK( worldState.removePlayer( 1 ) == INVALID_WORLD_STATE_INDEX );
+	}
+
+
+	void testWorldStateRadiusQuery() {
+
+		WorldState worldState;
+		worldState.addPlayer( 1, 5.0f, 5.0f, 0.0 );
+		worldState.addPlayer( 2, 100.0f, 100.0f, 0.0 );
+		worldState.addPlayer( 3, 0.0f, -10.0f, 0.0 );
+		worldState.addPlayer( 4, 200.0f, 0.0f, 0.0 );
+		worldState.addPlayer( 5, 96.0f, 97.0f, 0.0 );
+
+		// Crosses a group of four, and the zeroed padding at the origin must not match
+		CHECK( worldState.findPlayersWithinRadius( 0.0f, 0.0f, 10.0f ) == 0x5 );
+		CHECK( worldState.findPlayersWithinRadius( 100.0f, 100.0f, 5.0f ) == 0x12 );
+		CHECK( worldState.findPlayersWithinRadius( 500.0f, 500.0f, 1.0f ) == 0 );
+
+		// Full room, every bit of the mask in use
+		WorldState fullWorldState;
+		for ( int i = 0; i < MAX_PLAYERS_PER_ROOM; ++i ) {
+
+			fullWorldState.addPlayer( i + 1, static_cast<float>( i ), 0.0f, 0.0 );
+		}
+
+		CHECK( fullWorldState.findPlayersWithinRadius( 0.0f, 0.0f, 1000.0f ) == ~static_cast<uint64_t>( 0 ) );
+		CHECK( fullWorldState.findPlayersWithinRadius( 63.0f, 0.0f, 0.5f ) == ( static_cast<uint64_t>( 1 ) << 63 ) );
+	}
+
+
+	void testSnapshotCacheRoundTrip() {
+
+		WorldState worldState;
+		worldState.addPlayer( 1, 10.0f, 20.0f, 0.0 );
+		worldState.addPlayer( 2, -30.0f, 40.0f, 0.0 );
+		worldState.addPlayer( 3, 50.0f, -60.0f, 0.0 );
+
+		SnapshotBuilder snapshotBuilder;
+		SnapshotCache snapshotCache;
+		char builtPacket[ MAX_SNAPSHOT_PACKET_SIZE ];
+		char cachedPacket[ MAX_SNAPSHOT_PACKET_SIZE ];
+
+		CHECK( snapshotCache.buildFullSnapshot( cachedPacket ) == 0 );
+
+		// The first snapshot is full, and the cache hands it back byte for byte
+		int fullSize = snapshotBuilder.buildSnapshot( worldState, 7, 1.0f, 2.0f, builtPacket );
+		CHECK( fullSize == static_cast<int>( sizeof( SnapshotHeader ) + 3 * sizeof( SnapshotEntry ) ) );
+		CHECK( snapshotCache.applySnapshot( builtPacket, fullSize ) );
+		CHECK( snapshotCache.buildFullSnapshot( cachedPacket ) == fullSize );
+		CHECK( memcmp( builtPacket, cachedPacket, fullSize ) == 0 );
+
+		// Nothing moved, nothing to send
+		CHECK( snapshotBuilder.buildSnapshot( worldState, 7, 1.0f, 2.0f, builtPacket ) == 0 );
+
+		// A delta lists only the moved player and the cache folds it in
+		worldState.m_positionX[1] = -31.0f;
+		int deltaSize = snapshotBuilder.buildSnapshot( worldState, 7, 1.0f, 2.0f, builtPacket );
+		CHECK( deltaSize == static_cast<int>( sizeof( SnapshotHeader ) + sizeof( SnapshotEntry ) ) );
+
+		SnapshotHeader deltaHeader;
+		memcpy( &deltaHeader, builtPacket, sizeof( deltaHeader ) );
+		CHECK( ( deltaHeader.m_flags & SNAPSHOT_FLAG_FULL ) == 0 );
+		CHECK( snapshotCache.applySnapshot( builtPacket, deltaSize ) );
+
+		// The same delta again is stale
+		CHECK( !snapshotCache.applySnapshot( builtPacket, deltaSize ) );
+
+		// Rebuilt full snapshot carries the new position and the latest sequence
+		int cachedSize = snapshotCache.buildFullSnapshot( cachedPacket );
+		CHECK( cachedSize == fullSize );
+
+		SnapshotHeader cachedHeader;
+		memcpy( &cachedHeader, cachedPacket, sizeof( cachedHeader ) );
+		CHECK( ( cachedHeader.m_flags & SNAPSHOT_FLAG_FULL ) != 0 );
+		CHECK( cachedHeader.m_sequence == deltaHeader.m_sequence );
+		CHECK( cachedHeader.m_sessionID == 7 );
+
+		SnapshotEntry cachedEntry;
+		memcpy( &cachedEntry, cachedPacket + sizeof( SnapshotHeader ) + sizeof( SnapshotEntry ), sizeof( cachedEntry ) );
+		CHECK( cachedEntry.m_playerID == 2 );
+		CHECK( cachedEntry.m_xPosition == static_cast<short>( -31.0f * POSITION_QUANTIZATION_SCALE ) );
+		CHECK( cachedEntry.m_yPosition == static_cast<short>( 40.0f * POSITION_QUANTIZATION_SCALE ) );
+
+		// Truncated packets are refused
+		CHECK( !snapshotCache.applySnapshot( builtPacket, deltaSize - 1 ) );
+	}
+}
+
+
+int main( int argc, char** argv ) {
+
+	testSipHashReferenceVector();
+	testHandshakeCookieEpochs();
+	testTokenBucketBurstAndRefill();
+	testWorldStateSwapRemove();
+	testWorldStateRadiusQuery();
+	testSnapshotCacheRoundTrip();
+
+	printf( "%d checks, %d failed\n", g_numChecks, g_numFailedChecks );
+	return ( g_numFailedChecks == 0 ) ? 0 : 1;
+}
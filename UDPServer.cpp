@@ -1,5 +1,6 @@
 #include "UDPServer.hpp"
 #include <stdio.h>
+#include <string.h>
 #include <iostream>
 
 #include <vector>
@@ -11,12 +12,23 @@
 #include <locale>
 
 #include "ConnectedUDPClient.hpp"
+#include "GameRoom.hpp"
+#include "AsyncLogger.hpp"
 
 #include "../../CBEngine/EngineCode/TimeUtil.hpp"
 #include "../../CBEngine/EngineCode/MathUtil.hpp"
 
 UDPServer::~UDPServer() {
 
+	m_workerPool.stop();
+
+	std::map<int,GameRoom*>::iterator itRoom;
+	for ( itRoom = m_rooms.begin(); itRoom != m_rooms.end(); ++itRoom ) {
+
+		delete itRoom->second;
+	}
+
+	m_rooms.clear();
 }
 
 
@@ -27,12 +39,27 @@ UDPServer::UDPServer( const std::string& ipAddress, const std::string& portNumbe
 	m_IPAddress = ipAddress;
 	m_PortNumber = portNumber;
 
+	m_listenSocket = INVALID_SOCKET;
+	m_serverShouldRun = false;
+
+	m_lastRoomTickTimeSeconds = 0.0;
 	m_durationSinceLastUserConnectedUpdate = 0.0;
-	m_durationSinceLastPacketUpdate = 0.0;
-	
-	m_currentAckCount = 0;
+	m_numWorkerThreads = WorkerPool::getDefaultNumWorkers();
+
+	m_numUnsolicitedPacketsDropped = 0;
+	m_numInvalidCookiesDropped = 0;
+
+	m_perClientRateLimit = RateLimitConfig( DEFAULT_CLIENT_PACKETS_PER_SECOND, DEFAULT_CLIENT_BURST_SIZE );
+	m_perRelayRateLimit = makePerRelayRateLimit( m_perClientRateLimit );
+	m_perUnknownSourceRateLimit = RateLimitConfig( DEFAULT_UNKNOWN_SOURCE_PACKETS_PER_SECOND, DEFAULT_UNKNOWN_SOURCE_BURST_SIZE );
+	m_allUnknownSourcesRateLimit = RateLimitConfig( DEFAULT_ALL_UNKNOWN_SOURCES_PACKETS_PER_SECOND, DEFAULT_ALL_UNKNOWN_SOURCES_BURST_SIZE );
+	m_perSourceRoomCreationRateLimit = RateLimitConfig( ROOM_CREATIONS_PER_SOURCE_PER_SECOND, ROOM_CREATION_BURST_PER_SOURCE );
+	m_allRoomCreationRateLimit = RateLimitConfig( ROOM_CREATIONS_PER_SECOND, ROOM_CREATION_BURST );
+	m_numPacketsDroppedByUnknownSourceRateLimit = 0;
+	m_numPacketsDroppedByClientRateLimit = 0;
 
 	srand( time( nullptr ) );
+	m_cookieGenerator.initializeSecret();
 }
 
 
@@ -103,47 +130,243 @@ void UDPServer::initialize() {
 	}
 
 	freeaddrinfo(result);
+
+	loadRelayAllowlist( RELAY_ALLOWLIST_FILE_PATH, m_relayAllowlist );
+	createStateFile();
+}
+
+
+HandoverResult UDPServer::initializeFromHandover() {
+
+	printf( "\n\nAttempting to take over the UDP Server already running with state file: %s \n", SESSION_STATE_FILE_PATH );
+
+	WSAData wsaData;
+	int winSockResult = 0;
+
+	winSockResult = WSAStartup( MAKEWORD( 2, 2 ), &wsaData );
+	if ( winSockResult != 0 ) {
+
+		printf( "WSAStartup failed with error number: %d\n", winSockResult );
+		return HANDOVER_RESULT_NO_SERVER_RUNNING;
+	}
+
+	if ( !m_stateFile.openExisting( SESSION_STATE_FILE_PATH ) ) {
+
+		WSACleanup();
+		return HANDOVER_RESULT_NO_SERVER_RUNNING;
+	}
+
+	// Needed before the restore below, which re-checks every persisted relay against it
+	loadRelayAllowlist( RELAY_ALLOWLIST_FILE_PATH, m_relayAllowlist );
+
+	StateFileHeader* header = m_stateFile.getHeader();
+	header->m_handoverRequestPID = GetCurrentProcessId();
+	InterlockedExchange( &header->m_handoverState, HANDOVER_STATE_REQUESTED );
+
+	if ( !waitForHandoverState( HANDOVER_STATE_READY, HANDOVER_TIMEOUT_SECONDS ) ) {
+
+		// Withdraw the request, unless the old process answered just as we gave up
+		if ( InterlockedCompareExchange( &header->m_handoverState, HANDOVER_STATE_NONE, HANDOVER_STATE_REQUESTED ) != HANDOVER_STATE_READY ) {
+
+			// Nobody is serving the file. It stays open so initialize() can recover the sessions in it
+			printf( "No running server answered the handover request within %.1f seconds\n", HANDOVER_TIMEOUT_SECONDS );
+			WSACleanup();
+			return HANDOVER_RESULT_NO_SERVER_RUNNING;
+		}
+	}
+
+	m_listenSocket = WSASocketW( FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, &header->m_socketProtocolInfo, 0, WSA_FLAG_OVERLAPPED );
+	if ( m_listenSocket == INVALID_SOCKET ) {
+
+		// Hand the socket back rather than leave the old process to time out
+		printf( "WSASocket from the handed over protocol info failed with error number: %ld\n", WSAGetLastError() );
+		InterlockedCompareExchange( &header->m_handoverState, HANDOVER_STATE_NONE, HANDOVER_STATE_READY );
+		m_stateFile.close();
+		WSACleanup();
+		return HANDOVER_RESULT_ABANDONED;
+	}
+
+	// Claim the socket first, the old process only waits half a second before taking it back
+	if ( InterlockedCompareExchange( &header->m_handoverState, HANDOVER_STATE_COMPLETE, HANDOVER_STATE_READY ) != HANDOVER_STATE_READY ) {
+
+		// The old process gave up on us and is serving again. Its file and port are still in use.
+		printf( "The running server took its socket back before the handover completed\n" );
+		closesocket( m_listenSocket );
+		m_listenSocket = INVALID_SOCKET;
+		m_stateFile.close();
+		WSACleanup();
+		return HANDOVER_RESULT_ABANDONED;
+	}
+
+	u_long iMode = 1; // 0 = blocking ... != 0 is non blocking
+	winSockResult = ioctlsocket( m_listenSocket, FIONBIO, &iMode );
+	if ( winSockResult != NO_ERROR ) {
+
+		printf( "ioctlsocket failed with error: %ld\n", winSockResult );
+	}
+
+	// The old process stopped ticking before READY and exits on COMPLETE, so every room in the file is final
+	restoreRoomsFromStateFile();
+
+	return HANDOVER_RESULT_TAKEN_OVER;
+}
+
+
+void UDPServer::setRateLimits( const RateLimitConfig& perClientConfig, const RateLimitConfig& perUnknownSourceConfig, const RateLimitConfig& allUnknownSourcesConfig ) {
+
+	m_perClientRateLimit = perClientConfig;
+	m_perRelayRateLimit = makePerRelayRateLimit( m_perClientRateLimit );
+	m_perUnknownSourceRateLimit = perUnknownSourceConfig;
+	m_allUnknownSourcesRateLimit = allUnknownSourcesConfig;
+
+	printf( "Client rate limit: %.1f packets per second, burst of %.1f\n", m_perClientRateLimit.m_packetsPerSecond, m_perClientRateLimit.m_burstSize );
+	printf( "Unknown source rate limit: %.1f packets per second, burst of %.1f\n", m_perUnknownSourceRateLimit.m_packetsPerSecond, m_perUnknownSourceRateLimit.m_burstSize );
+	printf( "All unknown sources rate limit: %.1f packets per second, burst of %.1f\n", m_allUnknownSourcesRateLimit.m_packetsPerSecond, m_allUnknownSourcesRateLimit.m_burstSize );
+}
+
+
+unsigned int UDPServer::getNumPacketsDroppedByClientRateLimit() const {
+
+	unsigned int numDropped = m_numPacketsDroppedByClientRateLimit;
+
+	std::map<int,GameRoom*>::const_iterator itRoom;
+	for ( itRoom = m_rooms.begin(); itRoom != m_rooms.end(); ++itRoom ) {
+
+		numDropped += static_cast<unsigned int>( itRoom->second->getNumPacketsDroppedByRateLimit() );
+	}
+
+	return numDropped;
 }
 
 
 void UDPServer::run() {
 
 	int winSockResult = 0;
-	int winSockSendResult = 0;
 	m_serverShouldRun = true;
 
+	m_workerPool.start( m_numWorkerThreads );
+	m_lastRoomTickTimeSeconds = cbutil::getCurrentTimeSeconds();
+
 	while ( m_serverShouldRun ) {
 
-		checkForExpiredClients();
-		displayConnectedUsers();
+		// Drain what the socket has, bounded so room ticks are never starved
+		for ( int i = 0; i < MAX_PACKETS_RECEIVED_PER_LOOP; ++i ) {
+
+			// Large enough for a relayed packet, the biggest thing anyone sends us
+			char packetBuffer[ sizeof( RelayedPacket ) ];
+
+			sockaddr_in clientSocketAddr;
+			int sizeOfResultAddress = sizeof( clientSocketAddr );
+			winSockResult = recvfrom( m_listenSocket, packetBuffer, sizeof( packetBuffer ), 0, (sockaddr*) &clientSocketAddr, &sizeOfResultAddress );
 
-		PlayerDataPacket packetReceived;
+			if ( winSockResult <= 0 ) {
 
-		sockaddr_in clientSocketAddr;
-		int sizeOfResultAddress = sizeof( clientSocketAddr );
-		winSockResult = recvfrom( m_listenSocket, (char*) &packetReceived, sizeof( PlayerDataPacket ), 0, (sockaddr*) &clientSocketAddr, &sizeOfResultAddress );
+				break;
+			}
+
+			// Velocity estimates use this rather than when a worker gets to the packet
+			double receiveTimeSeconds = cbutil::getCurrentTimeSeconds();
+
+			unsigned char packetID = static_cast<unsigned char>( packetBuffer[0] );
+			if ( !isKnownPacketID( packetID ) ) {
+
+				// Cheap reject before any string building or table lookups
+				++m_numUnsolicitedPacketsDropped;
+				continue;
+			}
+
+			// Integer keyed, an unknown source costs no formatting or allocation before the handshake
+			std::map<AddressKey,KnownSource>::iterator itSession;
+			itSession = m_sessionForAddress.find( makeAddressKey( clientSocketAddr ) );
+
+			if ( itSession == m_sessionForAddress.end() ) {
+
+				// Throttle before the packet is even parsed
+				if ( !m_unknownSourceRateLimiter.tryConsume( clientSocketAddr, m_perUnknownSourceRateLimit, m_allUnknownSourcesRateLimit, receiveTimeSeconds ) ) {
+
+					++m_numPacketsDroppedByUnknownSourceRateLimit;
+					continue;
+				}
+
+				// Nothing is allocated for an unknown source until it proves it can receive at its address
+				if ( winSockResult != sizeof( PlayerDataPacket ) ) {
+
+					++m_numUnsolicitedPacketsDropped;
+					continue;
+				}
+
+				PlayerDataPacket packetReceived;
+				memcpy( &packetReceived, packetBuffer, sizeof( packetReceived ) );
+				handlePacketFromUnknownSource( clientSocketAddr, packetReceived, receiveTimeSeconds );
+				continue;
+			}
+
+			KnownSource& knownSource = itSession->second;
+
+			if ( packetID == RELAYED_PACKET_ID ) {
+
+				// The room throttles each wrapped client as well, this keeps a flood off the inbox in the first place
+				if ( !knownSource.m_relayedRateLimitBucket.tryConsume( m_perRelayRateLimit, receiveTimeSeconds ) ) {
+
+					++m_numPacketsDroppedByClientRateLimit;
+					continue;
+				}
+
+				if ( winSockResult != sizeof( RelayedPacket ) ) {
+
+					++m_numUnsolicitedPacketsDropped;
+					continue;
+				}
+
+				RelayedPacket relayedPacket;
+				memcpy( &relayedPacket, packetBuffer, sizeof( relayedPacket ) );
+				dispatchRelayedPacket( knownSource, clientSocketAddr, relayedPacket, receiveTimeSeconds );
+				continue;
+			}
+
+			if ( !knownSource.m_rateLimitBucket.tryConsume( m_perClientRateLimit, receiveTimeSeconds ) ) {
+
+				++m_numPacketsDroppedByClientRateLimit;
+				continue;
+			}
+
+			if ( winSockResult != sizeof( PlayerDataPacket ) ) {
+
+				++m_numUnsolicitedPacketsDropped;
+				continue;
+			}
+
+			PlayerDataPacket packetReceived;
+			memcpy( &packetReceived, packetBuffer, sizeof( packetReceived ) );
+			dispatchPacket( knownSource.m_sessionID, clientSocketAddr, packetReceived, receiveTimeSeconds );
+		}
+
+		scheduleRoomTicks();
+		displayServerSummary();
+
+		if ( checkForHandoverRequest() ) {
 
-		if ( winSockResult > 0 ) {
+			// Last ticks have to land in the state file before the new process reads it
+			m_workerPool.stop();
 
-			char* connectedIP = inet_ntoa( clientSocketAddr.sin_addr );
-			int portNumber = ntohs( clientSocketAddr.sin_port );
-			
-			std::string combinedIPAndPort;
-			convertIPAndPortToSingleString( connectedIP, portNumber, combinedIPAndPort );
-			updateOrCreateNewClient( combinedIPAndPort, clientSocketAddr, packetReceived );
+			if ( completeHandover() ) {
 
-			// Debug Stuff
-			//printf( "Num Bytes received: %d\n", winSockResult );
-			//printf( "Client IP of packet sent: %s  Port: %d \n", connectedIP, portNumber );
-			//printf( "Position X: %f", packetReceived.m_xPos );
-			//printf( "Position Y: %f", packetReceived.m_yPos );
-			
-		} 
+				m_serverShouldRun = false;
 
-		sendPlayerDataToClients();
-		checkForExpiredReliablePacketsWithNoAcks();
+			} else {
+
+				std::map<int,GameRoom*>::iterator itRoom;
+				for ( itRoom = m_rooms.begin(); itRoom != m_rooms.end(); ++itRoom ) {
+
+					itRoom->second->cancelScheduledTick();
+				}
+
+				m_workerPool.start( m_numWorkerThreads );
+			}
+		}
 	} 
 
+	m_workerPool.stop();
 	WSACleanup();
 
 	printf( "UDP Server has finished executing\n\n" );
@@ -152,255 +375,477 @@ void UDPServer::run() {
 
 void UDPServer::convertIPAndPortToSingleString( char* ipAddress, int portNumber, std::string& out_combinedIPAndPort ) {
 
-	char* portNumAsCString = new char[32];
+	char portNumAsCString[32];
 	itoa( portNumber, portNumAsCString, 10 );
 
+	// Separated, or 10.0.0.1 port 23456 and 10.0.0.12 port 3456 come out the same
 	out_combinedIPAndPort += ipAddress;
+	out_combinedIPAndPort += ':';
 	out_combinedIPAndPort += portNumAsCString;
+}
+
+
+void UDPServer::loadRelayAllowlist( const char* filePath, std::set<u_long>& out_allowedAddresses ) {
+
+	out_allowedAddresses.clear();
+
+	FILE* allowlistFile = nullptr;
+	if ( fopen_s( &allowlistFile, filePath, "r" ) != 0 || allowlistFile == nullptr ) {
+
+		printf( "No relay allowlist at %s, subscribers may watch but not relay\n", filePath );
+		return;
+	}
+
+	char line[64];
+	while ( fgets( line, sizeof( line ), allowlistFile ) != nullptr ) {
+
+		line[ strcspn( line, "\r\n" ) ] = '\0';
+		if ( line[0] == '\0' || line[0] == '#' ) {
+
+			continue;
+		}
+
+		in_addr relayAddress;
+		if ( inet_pton( AF_INET, line, &relayAddress ) != 1 ) {
 
-	delete[] portNumAsCString;
+			printf( "Ignoring relay allowlist entry that is not an IPv4 address: %s\n", line );
+			continue;
+		}
+
+		out_allowedAddresses.insert( relayAddress.s_addr );
+	}
+
+	fclose( allowlistFile );
+	printf( "Relays allowed from %u addresses\n", static_cast<unsigned int>( out_allowedAddresses.size() ) );
 }
 
 
-void UDPServer::updateOrCreateNewClient( const std::string& combinedIPAndPort, const sockaddr_in& clientAddress, const PlayerDataPacket& playerData ) {
+bool UDPServer::isAllowedRelayAddress( const sockaddr_in& address ) const {
 
-	std::map<std::string,ConnectedUDPClient*>::iterator itClient;
+	return m_relayAllowlist.find( address.sin_addr.s_addr ) != m_relayAllowlist.end();
+}
 
-	itClient = m_clients.find( combinedIPAndPort );
 
-	if ( itClient != m_clients.end() ) {
+bool UDPServer::isKnownPacketID( unsigned char packetID ) const {
 
-		// Update existing client
-		if ( playerData.m_packetID == RELIABLE_ACK_ID ) {
+	return packetID == PLAYER_DATA_PACKET_ID
+		|| packetID == PLAYER_EXIT_DATA_PACKET_ID
+		|| packetID == RELIABLE_ACK_ID
+		|| packetID == CONNECTION_REQUEST_ID
+		|| packetID == CONNECTION_RESPONSE_ID
+		|| packetID == RELAY_SUBSCRIBE_ID
+		|| packetID == RELAYED_PACKET_ID;
+}
 
-			double currentTimeInSeconds = cbutil::getCurrentTimeSeconds();
-			int ackCountID = playerData.m_packetAckID;
 
-			ConnectedUDPClient* client = itClient->second;
-			client->m_timeStampSecondsForLastPacketReceived = currentTimeInSeconds;
+void UDPServer::dispatchRelayedPacket( const KnownSource& relaySource, const sockaddr_in& relayAddress, const RelayedPacket& relayedPacket, double receiveTimeSeconds ) {
 
-			std::map<int,PlayerDataPacket>::iterator itAck;
-			itAck = client->m_reliablePacketsSentButNotAcked.find( ackCountID );
-			if ( itAck != client->m_reliablePacketsSentButNotAcked.end() ) {
+	// Players and watchers never speak for anyone else, and a relay only for clients in the room it subscribed to
+	if ( !relaySource.m_isAllowedToRelay || relayedPacket.m_packet.m_sessionID != relaySource.m_sessionID ) {
 
-				client->m_reliablePacketsSentButNotAcked.erase( itAck );
-			}
+		++m_numUnsolicitedPacketsDropped;
+		return;
+	}
 
-		} else {
+	std::map<int,GameRoom*>::iterator itRoom;
+	itRoom = m_rooms.find( relaySource.m_sessionID );
 
-			// Terrible 
-			ConnectedUDPClient* client = itClient->second;
-			double currentTimeInSeconds = cbutil::getCurrentTimeSeconds();
-			client->m_timeStampSecondsForLastPacketReceived = currentTimeInSeconds;
-			client->m_position.x = playerData.m_xPos;
-			client->m_position.y = playerData.m_yPos;
-		}
-	
-	} else {
-
-		double currentTimeInSeconds = cbutil::getCurrentTimeSeconds();
-		ConnectedUDPClient* client = new ConnectedUDPClient;
-		client->m_clientAddress = clientAddress;
-		client->m_userID = combinedIPAndPort;
-		client->m_timeStampSecondsForLastPacketReceived = currentTimeInSeconds;
-		client->m_position.x = playerData.m_xPos;
-		client->m_position.y = playerData.m_yPos;
-		m_clients.insert( std::pair<std::string,ConnectedUDPClient*>( combinedIPAndPort, client ) );
-
-		printf( "A new client has been created: %s \n", combinedIPAndPort.c_str() );
-
-		
-		// Send an ack
-		PlayerDataPacket playerData;
-		playerData.m_packetID = NEW_PLAYER_ACK_ID;
-		playerData.m_playerID = client->m_playerID;
-		playerData.m_xPos = client->m_position.x;
-		playerData.m_yPos = client->m_position.y;
-		playerData.m_red = client->m_red;
-		playerData.m_green = client->m_green;
-		playerData.m_blue = client->m_blue;
-
-		int winSockSendResult = 0;
-		winSockSendResult = sendto( m_listenSocket, (char*) &playerData, sizeof( playerData ), 0, (sockaddr*) &client->m_clientAddress, sizeof( client->m_clientAddress ) );
-
-		if ( winSockSendResult == SOCKET_ERROR ) {
-
-			printf( "send function call failed with error number: %d\n", WSAGetLastError() );
-		}
+	if ( itRoom == m_rooms.end() ) {
+
+		return;
+	}
+
+	sockaddr_in clientAddress;
+	ZeroMemory( &clientAddress, sizeof( clientAddress ) );
+	clientAddress.sin_family = AF_INET;
+	clientAddress.sin_addr.s_addr = relayedPacket.m_clientAddress;
+	clientAddress.sin_port = relayedPacket.m_clientPort;
+
+	// The relay ran the handshake with the client, the room checks the relay is still subscribed
+	itRoom->second->queueRelayedPacket( clientAddress, relayedPacket.m_packet, relayAddress, receiveTimeSeconds );
+}
+
+
+void UDPServer::dispatchPacket( int sessionID, const sockaddr_in& clientAddress, const PlayerDataPacket& playerData, double receiveTimeSeconds ) {
+
+	// A connected address may only talk to the room it joined
+	if ( playerData.m_sessionID != sessionID ) {
+
+		++m_numUnsolicitedPacketsDropped;
+		return;
+	}
+
+	std::map<int,GameRoom*>::iterator itRoom;
+	itRoom = m_rooms.find( sessionID );
+
+	if ( itRoom != m_rooms.end() ) {
+
+		itRoom->second->queueIncomingPacket( clientAddress, playerData, false, receiveTimeSeconds );
 	}
 }
 
 
-void UDPServer::checkForExpiredClients() {
+void UDPServer::handlePacketFromUnknownSource( const sockaddr_in& clientAddress, const PlayerDataPacket& playerData, double receiveTimeSeconds ) {
 
-	std::map<std::string,ConnectedUDPClient*>::iterator itClient;
-	std::vector<std::string> clientsToRemove;
+	if ( playerData.m_packetID == CONNECTION_REQUEST_ID ) {
 
-	for ( itClient = m_clients.begin(); itClient != m_clients.end(); ++itClient ) {
+		sendHandshakeChallenge( clientAddress, playerData.m_sessionID );
+		return;
+	}
 
-		ConnectedUDPClient* client = itClient->second;
-		double lastTimePacketReceived = client->m_timeStampSecondsForLastPacketReceived;
-		double currentTimeSeconds = cbutil::getCurrentTimeSeconds();
+	// A relay subscribes with the same handshake a player joins with
+	if ( playerData.m_packetID != CONNECTION_RESPONSE_ID && playerData.m_packetID != RELAY_SUBSCRIBE_ID ) {
 
-		double secondsSinceLastPacketReceived = currentTimeSeconds - lastTimePacketReceived;
+		++m_numUnsolicitedPacketsDropped;
+		return;
+	}
 
-		if ( secondsSinceLastPacketReceived > DURATION_THRESHOLD_FOR_DISCONECT ) {
+	unsigned int echoedCookie = static_cast<unsigned int>( playerData.m_packetAckID );
+	if ( !m_cookieGenerator.isCookieValid( echoedCookie, clientAddress, receiveTimeSeconds ) ) {
 
-			clientsToRemove.push_back( itClient->first );
-		}
+		++m_numInvalidCookiesDropped;
+		return;
 	}
 
-	for ( int i = 0; i < static_cast<int>( clientsToRemove.size() ); ++i ) {
+	GameRoom* room = findOrCreateRoom( playerData.m_sessionID, clientAddress, receiveTimeSeconds );
+	if ( room == nullptr ) {
 
-		std::map<std::string,ConnectedUDPClient*>::iterator itClientRem;
-		itClientRem = m_clients.find( clientsToRemove[i] );
+		return;
+	}
 
-		if ( itClientRem != m_clients.end() ) {
+	// The room creates the client on its next tick
+	if ( room->queueIncomingPacket( clientAddress, playerData, true, receiveTimeSeconds ) ) {
 
-			ConnectedUDPClient* client = itClientRem->second;
-			delete client;
+		bool isAllowedToRelay = playerData.m_packetID == RELAY_SUBSCRIBE_ID && isAllowedRelayAddress( clientAddress );
+		rememberSource( makeAddressKey( clientAddress ), playerData.m_sessionID, isAllowedToRelay );
+	}
+}
 
-			m_clients.erase( itClientRem );
 
-			printf( "\nRemoving client due to inactivity. Client IP and Port: %s \n", clientsToRemove[i].c_str() );
-		}
+void UDPServer::sendHandshakeChallenge( const sockaddr_in& clientAddress, int sessionID ) {
+
+	// Reply is the same size as the request so the handshake can't be used for amplification
+	PlayerDataPacket challengePacket;
+	challengePacket.m_packetID = CONNECTION_CHALLENGE_ID;
+	challengePacket.m_sessionID = sessionID;
+	challengePacket.m_packetAckID = static_cast<int>( m_cookieGenerator.generateCookie( clientAddress, cbutil::getCurrentTimeSeconds() ) );
+
+	int winSockSendResult = 0;
+	winSockSendResult = sendto( m_listenSocket, (char*) &challengePacket, sizeof( challengePacket ), 0, (sockaddr*) &clientAddress, sizeof( clientAddress ) );
+
+	if ( winSockSendResult == SOCKET_ERROR ) {
+
+		LOG_ERROR_RATE_LIMITED( LOG_MSG_SEND_FAILED, WSAGetLastError() );
 	}
 }
 
 
-void UDPServer::sendPlayerDataToClients() {
+GameRoom* UDPServer::findOrCreateRoom( int sessionID, const sockaddr_in& clientAddress, double currentTimeSeconds ) {
+
+	std::map<int,GameRoom*>::iterator itRoom;
+	itRoom = m_rooms.find( sessionID );
+
+	if ( itRoom != m_rooms.end() ) {
+
+		return itRoom->second;
+	}
+
+	if ( static_cast<int>( m_rooms.size() ) >= MAX_ROOMS ) {
+
+		LOG_ERROR_RATE_LIMITED( LOG_MSG_ROOM_LIMIT_REACHED, static_cast<unsigned int>( MAX_ROOMS ), sessionID );
+		return nullptr;
+	}
 
-	static double lastTimeStampSeconds = cbutil::getCurrentTimeSeconds();
+	// Every session ID names a new room, so without this one source could cycle IDs and fill the table
+	sockaddr_in creatorAddress = clientAddress;
+	creatorAddress.sin_port = 0;
+
+	if ( !m_roomCreationRateLimiter.tryConsume( creatorAddress, m_perSourceRoomCreationRateLimit, m_allRoomCreationRateLimit, currentTimeSeconds ) ) {
+
+		LOG_ERROR_RATE_LIMITED( LOG_MSG_ROOM_CREATION_THROTTLED, clientAddress, sessionID );
+		return nullptr;
+	}
+
+	// Null when the state file is missing or full, the room then simply is not persisted
+	PersistedRoom* persistedRoom = m_stateFile.acquireRoom();
+
+	GameRoom* room = new GameRoom( sessionID, m_listenSocket, m_perClientRateLimit, m_thresholdForPacketLossSimulation, persistedRoom );
+	m_rooms.insert( std::pair<int,GameRoom*>( sessionID, room ) );
+
+	LOG_INFO( LOG_MSG_ROOM_CREATED, sessionID );
+
+	return room;
+}
+
+
+void UDPServer::scheduleRoomTicks() {
 
 	double currentTimeSeconds = cbutil::getCurrentTimeSeconds();
-	double timeDifSeconds = currentTimeSeconds - lastTimeStampSeconds;
+	if ( currentTimeSeconds - m_lastRoomTickTimeSeconds < TIME_DIF_SECONDS_FOR_ROOM_TICK ) {
 
-	m_durationSinceLastPacketUpdate += timeDifSeconds;
+		return;
+	}
 
-	if ( m_durationSinceLastPacketUpdate > TIME_DIF_SECONDS_FOR_PACKET_UPDATE ) {
+	m_durationSinceLastUserConnectedUpdate += currentTimeSeconds - m_lastRoomTickTimeSeconds;
+	m_lastRoomTickTimeSeconds = currentTimeSeconds;
 
-		m_durationSinceLastPacketUpdate = 0.0;
+	forgetDepartedClients();
 
-		std::vector<PlayerDataPacket> playerPackets;
-		int winSockSendResult = 0;
+	std::vector<GameRoom*> roomsToRetire;
 
-		std::map<std::string,ConnectedUDPClient*>::iterator itClient;
-		for ( itClient = m_clients.begin(); itClient != m_clients.end(); ++itClient ) {
+	std::map<int,GameRoom*>::iterator itRoom;
+	for ( itRoom = m_rooms.begin(); itRoom != m_rooms.end(); ++itRoom ) {
 
-			ConnectedUDPClient* client = itClient->second;
+		GameRoom* room = itRoom->second;
+		if ( !room->tryMarkTickScheduled() ) {
 
-			PlayerDataPacket playerData;
-			playerData.m_playerID = client->m_playerID;
-			playerData.m_xPos = client->m_position.x;
-			playerData.m_yPos = client->m_position.y;
-			playerData.m_red = client->m_red;
-			playerData.m_green = client->m_green;
-			playerData.m_blue = client->m_blue;
+			continue;
+		}
 
-			// TESTING FOR NOW
-			++m_currentAckCount;
-			playerData.m_packetAckID = m_currentAckCount;
+		// The mark is never cleared for a retired room, so no worker can pick it up again
+		if ( room->isIdle( currentTimeSeconds ) ) {
 
-			// Old
-			//playerPackets.push_back( playerData );
+			roomsToRetire.push_back( room );
+			continue;
 		}
 
-		std::map<std::string,ConnectedUDPClient*>::iterator itClientPacket;
-		for ( itClientPacket = m_clients.begin(); itClientPacket != m_clients.end(); ++itClientPacket ) {
+		m_workerPool.scheduleTask( room );
+	}
 
-			ConnectedUDPClient* client = itClientPacket->second;
+	for ( int i = 0; i < static_cast<int>( roomsToRetire.size() ); ++i ) {
 
-			for ( int i = 0; i < static_cast<int>( playerPackets.size() ); ++i ) {
+		retireRoom( roomsToRetire[i] );
+	}
+}
 
-				PlayerDataPacket& packetToSend = playerPackets[i];
 
-				double currentTimeSeconds = cbutil::getCurrentTimeSeconds();
-				packetToSend.m_packetTimeStamp = currentTimeSeconds;
-				client->m_reliablePacketsSentButNotAcked.insert( std::pair<int,PlayerDataPacket>( packetToSend.m_packetAckID, packetToSend ) );
+void UDPServer::retireRoom( GameRoom* room ) {
 
-				float randomNumberZeroToOne = cbengine::getRandomZeroToOne();
-				if ( randomNumberZeroToOne < m_thresholdForPacketLossSimulation ) {
-					// Send 
-					winSockSendResult = sendto( m_listenSocket, (char*) &packetToSend, sizeof( packetToSend ), 0, (sockaddr*) &client->m_clientAddress, sizeof( client->m_clientAddress ) );
+	int sessionID = room->getSessionID();
+	LOG_INFO( LOG_MSG_ROOM_RETIRED, sessionID, static_cast<unsigned int>( ROOM_IDLE_TIMEOUT_SECONDS ) );
 
-				} else {
-					// Don't send but act like we did
-					// Leaving this block for testing purposes
-				}
+	// Anything still routed here would otherwise be stuck talking to a room that no longer exists
+	std::map<AddressKey,KnownSource>::iterator itSource = m_sessionForAddress.begin();
+	while ( itSource != m_sessionForAddress.end() ) {
 
-				if ( winSockSendResult == SOCKET_ERROR ) {
+		if ( itSource->second.m_sessionID == sessionID ) {
 
-					printf( "send function call failed with error number: %d\n", WSAGetLastError() );
-				}
-			}
+			itSource = m_sessionForAddress.erase( itSource );
+
+		} else {
+
+			++itSource;
 		}
 	}
 
-	lastTimeStampSeconds = currentTimeSeconds;
+	m_stateFile.releaseRoom( room->getPersistedRoom() );
+	m_rooms.erase( sessionID );
+	delete room;
 }
 
 
-void UDPServer::displayConnectedUsers() {
+void UDPServer::rememberSource( AddressKey addressKey, int sessionID, bool isAllowedToRelay ) {
 
-	static double lastTimeStampSeconds = cbutil::getCurrentTimeSeconds();
+	KnownSource knownSource;
+	knownSource.m_sessionID = sessionID;
+	knownSource.m_rateLimitBucket.reset();
+	knownSource.m_relayedRateLimitBucket.reset();
+	knownSource.m_isAllowedToRelay = isAllowedToRelay;
 
+	m_sessionForAddress.insert( std::pair<AddressKey,KnownSource>( addressKey, knownSource ) );
+}
 
-	double currentTimeSeconds = cbutil::getCurrentTimeSeconds();
-	double timeDifSeconds = currentTimeSeconds - lastTimeStampSeconds;
 
-	m_durationSinceLastUserConnectedUpdate += timeDifSeconds;
+void UDPServer::forgetDepartedClients() {
 
-	if ( m_durationSinceLastUserConnectedUpdate > TIME_DIF_SECONDS_FOR_USER_DISPLAY ) {
+	std::vector<AddressKey> departedClients;
 
-		m_durationSinceLastUserConnectedUpdate = 0.0;
+	std::map<int,GameRoom*>::iterator itRoom;
+	for ( itRoom = m_rooms.begin(); itRoom != m_rooms.end(); ++itRoom ) {
 
-		if ( m_clients.empty() ) {
+		itRoom->second->collectDepartedClients( departedClients );
+	}
 
-			printf( "---- There are currently no clients connected ----\n\n" );
+	for ( int i = 0; i < static_cast<int>( departedClients.size() ); ++i ) {
 
-		} else {
+		m_sessionForAddress.erase( departedClients[i] );
+	}
+}
 
-			printf( "---- Displaying List Of Connected Clients ----\n\n");
 
-			std::map<std::string,ConnectedUDPClient*>::iterator itClient;
-			for ( itClient = m_clients.begin(); itClient != m_clients.end(); ++itClient ) {
+void UDPServer::displayServerSummary() {
 
-				ConnectedUDPClient* client = itClient->second;
-				printf( "Client with user ID: %s is connected to the server.\n", client->m_userID.c_str() );
-			}
+	if ( m_durationSinceLastUserConnectedUpdate <= TIME_DIF_SECONDS_FOR_USER_DISPLAY ) {
+
+		return;
+	}
+
+	m_durationSinceLastUserConnectedUpdate = 0.0;
 
-			printf( "---- End List Of Connected Clients ----\n\n");
+	unsigned int numUnsolicitedDroppedByRooms = 0;
+	unsigned int numQueueOverflowDrops = 0;
+
+	std::map<int,GameRoom*>::iterator itRoom;
+	for ( itRoom = m_rooms.begin(); itRoom != m_rooms.end(); ++itRoom ) {
+
+		numUnsolicitedDroppedByRooms += static_cast<unsigned int>( itRoom->second->getNumUnsolicitedPacketsDropped() );
+		numQueueOverflowDrops += static_cast<unsigned int>( itRoom->second->getNumQueueOverflowDrops() );
+	}
+
+	if ( ConnectedUDPClient::s_numberOfClients == 0 ) {
+
+		LOG_INFO( LOG_MSG_NO_CLIENTS_CONNECTED );
+	}
+
+	LOG_INFO( LOG_MSG_ROOM_SUMMARY, static_cast<unsigned int>( m_rooms.size() ), static_cast<unsigned int>( ConnectedUDPClient::s_numberOfClients ), static_cast<unsigned int>( m_workerPool.getNumWorkers() ) );
+	LOG_INFO( LOG_MSG_DROPPED_PACKET_TOTALS, m_numUnsolicitedPacketsDropped + numUnsolicitedDroppedByRooms, m_numInvalidCookiesDropped );
+	LOG_INFO( LOG_MSG_RATE_LIMITED_TOTALS, getNumPacketsDroppedByClientRateLimit(), m_numPacketsDroppedByUnknownSourceRateLimit );
+	LOG_INFO( LOG_MSG_ROOM_QUEUE_OVERFLOW_TOTALS, numQueueOverflowDrops );
+}
+
+
+void UDPServer::createStateFile() {
+
+	// A failed handover leaves the old file open, pick up whatever sessions it holds
+	if ( m_stateFile.isOpen() ) {
+
+		restoreRoomsFromStateFile();
+		return;
+	}
+
+	if ( !m_stateFile.create( SESSION_STATE_FILE_PATH ) ) {
+
+		printf( "Continuing without a state file, hot restart will not be available\n" );
+		return;
+	}
+}
+
+
+void UDPServer::restoreRoomsFromStateFile() {
+
+	// The cookie secret is never written to the file. Connected clients are restored by address and need
+	// no cookie, a client caught mid handshake gets a fresh challenge from this process on its retry.
+	StateFileHeader* header = m_stateFile.getHeader();
+
+	int numRoomSlots = header->m_numRooms;
+	if ( numRoomSlots > MAX_PERSISTED_ROOMS ) {
+
+		numRoomSlots = MAX_PERSISTED_ROOMS;
+	}
+
+	unsigned int numClientsRestored = 0;
+	for ( int slot = 0; slot < numRoomSlots; ++slot ) {
+
+		PersistedRoom* persistedRoom = m_stateFile.getRoom( slot );
+
+		// Never ticked, retired, or torn by a crash mid write. The slot goes back to the free list.
+		LONG writeSequence = persistedRoom->m_writeSequence;
+		if ( writeSequence == 0 || ( writeSequence & 1 ) != 0 ) {
+
+			m_stateFile.releaseRoom( persistedRoom );
+			continue;
+		}
+
+		int sessionID = persistedRoom->m_sessionID;
+		if ( m_rooms.find( sessionID ) != m_rooms.end() ) {
+
+			m_stateFile.releaseRoom( persistedRoom );
+			continue;
 		}
+
+		GameRoom* room = new GameRoom( sessionID, m_listenSocket, m_perClientRateLimit, m_thresholdForPacketLossSimulation, persistedRoom );
+		m_rooms.insert( std::pair<int,GameRoom*>( sessionID, room ) );
+
+		std::vector<AddressKey> restoredClients;
+		std::vector<sockaddr_in> restoredRelays;
+		room->restoreFromPersistedRoom( restoredClients, restoredRelays );
+
+		for ( int i = 0; i < static_cast<int>( restoredClients.size() ); ++i ) {
+
+			rememberSource( restoredClients[i], sessionID, false );
+		}
+
+		// Checked against this process's allowlist, which may have changed since the relay subscribed
+		for ( int i = 0; i < static_cast<int>( restoredRelays.size() ); ++i ) {
+
+			rememberSource( makeAddressKey( restoredRelays[i] ), sessionID, isAllowedRelayAddress( restoredRelays[i] ) );
+		}
+
+		numClientsRestored += static_cast<unsigned int>( room->getNumClients() );
 	}
 
-	lastTimeStampSeconds = currentTimeSeconds;
+	LOG_INFO( LOG_MSG_STATE_RESTORED, static_cast<unsigned int>( m_rooms.size() ), numClientsRestored );
 }
 
 
-void UDPServer::checkForExpiredReliablePacketsWithNoAcks() {
+bool UDPServer::checkForHandoverRequest() {
 
-	double currentTimeSeconds = cbutil::getCurrentTimeSeconds();
+	if ( !m_stateFile.isOpen() ) {
 
-	std::map<std::string,ConnectedUDPClient*>::iterator itClient;
-	for ( itClient = m_clients.begin(); itClient != m_clients.end(); ++itClient ) {
+		return false;
+	}
 
-		ConnectedUDPClient* client = itClient->second;
+	return m_stateFile.getHeader()->m_handoverState == HANDOVER_STATE_REQUESTED;
+}
 
-		std::map<int,PlayerDataPacket>::iterator itRel;
-		for ( itRel = client->m_reliablePacketsSentButNotAcked.begin(); itRel != client->m_reliablePacketsSentButNotAcked.end(); ++itRel ) {
 
-			int ackCountIDForPacket = itRel->first;
-			PlayerDataPacket& packet = itRel->second;
-			double timeStampForSendPacket = packet.m_packetTimeStamp;
+bool UDPServer::completeHandover() {
 
-			double timeDifSeconds = currentTimeSeconds - timeStampForSendPacket;
+	StateFileHeader* header = m_stateFile.getHeader();
+	unsigned int newProcessID = static_cast<unsigned int>( header->m_handoverRequestPID );
 
-			if ( timeDifSeconds > TIME_THRESHOLD_TO_RESEND_RELIABLE_PACKETS ) {
+	LOG_INFO( LOG_MSG_HANDOVER_REQUESTED, newProcessID );
 
-				packet.m_packetTimeStamp = currentTimeSeconds;
-				int winSockSendResult = 0;
-				winSockSendResult = sendto( m_listenSocket, (char*) &packet, sizeof( packet ), 0, (sockaddr*) &client->m_clientAddress, sizeof( client->m_clientAddress ) );
-			}
+	if ( WSADuplicateSocketW( m_listenSocket, header->m_handoverRequestPID, &header->m_socketProtocolInfo ) == SOCKET_ERROR ) {
+
+		printf( "WSADuplicateSocket failed with error number: %ld\n", WSAGetLastError() );
+		InterlockedCompareExchange( &header->m_handoverState, HANDOVER_STATE_NONE, HANDOVER_STATE_REQUESTED );
+		return false;
+	}
+
+	// The requester may have given up already, then there is nobody to hand over to
+	if ( InterlockedCompareExchange( &header->m_handoverState, HANDOVER_STATE_READY, HANDOVER_STATE_REQUESTED ) != HANDOVER_STATE_REQUESTED ) {
+
+		return false;
+	}
+
+	// Rooms are not ticking while we wait, so this is bounded to half a second before serving again
+	if ( !waitForHandoverState( HANDOVER_STATE_COMPLETE, HANDOVER_COMPLETE_TIMEOUT_SECONDS ) ) {
+
+		// Whichever compare exchange lands first decides who keeps the socket
+		LONG previousState = InterlockedCompareExchange( &header->m_handoverState, HANDOVER_STATE_NONE, HANDOVER_STATE_READY );
+		if ( previousState == HANDOVER_STATE_READY ) {
+
+			LOG_WARNING( LOG_MSG_HANDOVER_TIMED_OUT, newProcessID, HANDOVER_COMPLETE_TIMEOUT_SECONDS );
+			return false;
+		}
+
+		// The new process handed the socket back itself
+		if ( previousState != HANDOVER_STATE_COMPLETE ) {
+
+			return false;
 		}
 	}
-}
\ No newline at end of file
+
+	// Clients are left alone, they keep talking to the same address and the new process answers
+	LOG_INFO( LOG_MSG_HANDOVER_COMPLETE, static_cast<unsigned int>( m_rooms.size() ), newProcessID );
+	return true;
+}
+
+
+bool UDPServer::waitForHandoverState( LONG expectedState, double timeoutSeconds ) {
+
+	double startTimeSeconds = cbutil::getCurrentTimeSeconds();
+
+	while ( m_stateFile.getHeader()->m_handoverState != expectedState ) {
+
+		if ( cbutil::getCurrentTimeSeconds() - startTimeSeconds > timeoutSeconds ) {
+
+			return false;
+		}
+
+		Sleep( HANDOVER_POLL_INTERVAL_MILLISECONDS );
+	}
+
+	return true;
+}
@@ -2,8 +2,10 @@
 #define includedUDPServer
 #pragma once
 
+#include <stdint.h>
 #include <string>
 #include <map>
+#include <set>
 
 #include <winsock2.h>
 #include <ws2tcpip.h>
@@ -13,10 +15,43 @@
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 
+#include "HandshakeCookie.hpp"
+#include "RateLimiter.hpp"
+#include "WorkerPool.hpp"
+#include "SessionStateFile.hpp"
+
 const char PLAYER_DATA_PACKET_ID = 2;
 const char PLAYER_EXIT_DATA_PACKET_ID = 4;
 const char RELIABLE_ACK_ID	= 30;
+
+// Connection handshake ( cookie is carried in m_packetAckID )
+//   Client->Server: CONNECTION_REQUEST_ID
+//   Server->Client: CONNECTION_CHALLENGE_ID with cookie
+//   Client->Server: CONNECTION_RESPONSE_ID echoing the cookie
+//   Server->Client: NEW_PLAYER_ACK_ID
+const char CONNECTION_REQUEST_ID = 5;
+const char CONNECTION_CHALLENGE_ID = 6;
+const char CONNECTION_RESPONSE_ID = 7;
+
+// Server->ALL Clients each broadcast tick, layout in Snapshot.hpp
+const char SNAPSHOT_PACKET_ID = 8;
+
+// Relay tier ( see SnapshotRelay.hpp )
+//   Relay->Server: CONNECTION_REQUEST_ID, then RELAY_SUBSCRIBE_ID echoing the cookie, re-sent as a keep alive
+//   Server->Relay: each room snapshot once, the relay fans it out
+//   Both ways: RELAYED_PACKET_ID wraps one client's packet together with that client's address
+const char RELAY_SUBSCRIBE_ID = 9;
+const char RELAYED_PACKET_ID = 10;
+
+// A relay speaks for clients the server never handshook, so only addresses listed in this file may
+// send RELAYED_PACKET_ID. Anyone else who subscribes only watches. One IPv4 address per line, with
+// no port because a relay subscribes to each room from its own port.
+const char* const RELAY_ALLOWLIST_FILE_PATH = "FeedbackServer.relays";
+const int	 MAX_CLIENTS_PER_RELAY = 32; // Per room, so no one relay can fill a room
+const float  RELAYED_JOINS_PER_SECOND = 2.0f;
+const float  RELAYED_JOIN_BURST_SIZE = 8.0f;
 const int  PACKET_ACK_ID_NON_RELIABLE = -1;
+const int  DEFAULT_SESSION_ID = 0;
 
 struct PlayerDataPacket {
 public:
@@ -29,6 +64,7 @@ public:
 		  m_xPos( 0.0f ),
 		  m_yPos( 0.0f ),
 		  m_packetAckID( PACKET_ACK_ID_NON_RELIABLE ),
+		  m_sessionID( DEFAULT_SESSION_ID ),
 		  m_packetTimeStamp( 0.0 )
 	  {}
 
@@ -40,18 +76,81 @@ public:
 	  float				m_yPos;
 	  int				m_packetAckID;
 	  int				m_playerID;
+	  int				m_sessionID; // Room the packet is for, fills what was padding so the size is unchanged
 	  double			m_packetTimeStamp;
 };
 
 
+struct RelayedPacket {
+public:
+	RelayedPacket() :
+	  m_packetID( RELAYED_PACKET_ID ),
+		  m_clientAddress( 0 ),
+		  m_clientPort( 0 )
+	  {
+		  m_padding[0] = m_padding[1] = m_padding[2] = 0;
+	  }
+
+	  unsigned char		m_packetID;
+	  unsigned char		m_padding[3];
+	  unsigned int		m_clientAddress; // Network order
+	  unsigned short	m_clientPort; // Network order
+	  PlayerDataPacket	m_packet;
+};
+
+
+// Address and port packed into one integer, so lookups on the receive path never format strings
+typedef uint64_t AddressKey;
+
+inline AddressKey makeAddressKey( const sockaddr_in& address ) {
+
+	return ( static_cast<AddressKey>( address.sin_addr.s_addr ) << 16 ) | ntohs( address.sin_port );
+}
+
+// What the front keeps per address that passed the handshake
+struct KnownSource {
+	int													m_sessionID;
+	TokenBucket											m_rateLimitBucket; // Checked before the packet is formatted or queued
+	TokenBucket											m_relayedRateLimitBucket; // Shared by every client a relay wraps packets for
+	bool												m_isAllowedToRelay; // Subscribed from an allowlisted address
+};
+
+// Sized so a relay with a full set of clients, each at the per client limit, is never throttled here
+inline RateLimitConfig makePerRelayRateLimit( const RateLimitConfig& perClientConfig ) {
+
+	return RateLimitConfig( perClientConfig.m_packetsPerSecond * MAX_CLIENTS_PER_RELAY, perClientConfig.m_burstSize * MAX_CLIENTS_PER_RELAY );
+}
+
+
 const int	 NEW_PLAYER_ACK_ID = 3;
 const double DURATION_THRESHOLD_FOR_DISCONECT = 5.0;
 const double TIME_DIF_SECONDS_FOR_USER_DISPLAY = 5.5;
 const double TIME_DIF_SECONDS_FOR_PACKET_UPDATE = 0.0045;
 const double TIME_THRESHOLD_TO_RESEND_RELIABLE_PACKETS = 0.500;
-
-class ConnectedUDPClient;
-
+const double TIME_DIF_SECONDS_FOR_ROOM_TICK = TIME_DIF_SECONDS_FOR_PACKET_UPDATE;
+const int	 MAX_ROOMS = MAX_PERSISTED_ROOMS; // Every room gets a slot in the state file
+const float	 ROOM_CREATIONS_PER_SOURCE_PER_SECOND = 0.2f; // Per IP, a player joins one room at a time
+const float	 ROOM_CREATION_BURST_PER_SOURCE = 3.0f;
+const float	 ROOM_CREATIONS_PER_SECOND = 5.0f;
+const float	 ROOM_CREATION_BURST = 20.0f;
+const int	 MAX_PACKETS_RECEIVED_PER_LOOP = 256;
+const char* const SESSION_STATE_FILE_PATH = "FeedbackServer.state";
+const DWORD  HANDOVER_POLL_INTERVAL_MILLISECONDS = 1;
+const double HANDOVER_COMPLETE_TIMEOUT_SECONDS = 0.5; // Old process waits no longer than this without ticking, Sleep( 1 ) can last a whole 15.6 ms timer period
+
+typedef enum {
+
+	HANDOVER_RESULT_TAKEN_OVER,			// This process now owns the socket and every room
+	HANDOVER_RESULT_NO_SERVER_RUNNING,	// Start normally, restoring whatever the state file holds
+	HANDOVER_RESULT_ABANDONED,			// The running server kept its socket and file, do not start
+
+} HandoverResult;
+
+class GameRoom;
+
+// Front end for every room hosted by the process. Owns the one socket, runs
+// the handshake and unknown source filtering, then hands each datagram to the
+// room named by its session ID. Room ticks run on the worker pool.
 class UDPServer {
 public:
 	~UDPServer();
@@ -62,6 +161,23 @@ public:
 	void initialize();
 	void run();
 
+	// Hot restart: takes the socket and sessions over from the process already
+	// serving this state file. When nothing answered, initialize() should be used
+	// instead. When the running server kept its socket this process must not start.
+	HandoverResult initializeFromHandover();
+
+	static void convertIPAndPortToSingleString( char* ipAddress, int portNumber, std::string& out_combinedIPAndPort );
+
+	// A missing file leaves the allowlist empty, so subscribers can watch but never relay
+	static void loadRelayAllowlist( const char* filePath, std::set<u_long>& out_allowedAddresses );
+
+	// Applies to rooms created afterwards
+	void setRateLimits( const RateLimitConfig& perClientConfig, const RateLimitConfig& perUnknownSourceConfig, const RateLimitConfig& allUnknownSourcesConfig );
+	void setNumWorkerThreads( int numWorkerThreads ) { m_numWorkerThreads = numWorkerThreads; }
+
+	unsigned int getNumPacketsDroppedByClientRateLimit() const;
+	unsigned int getNumPacketsDroppedByUnknownSourceRateLimit() const { return m_numPacketsDroppedByUnknownSourceRateLimit; }
+
 protected:
 
 	SOCKET												m_listenSocket;
@@ -71,28 +187,58 @@ protected:
 
 	bool												m_serverShouldRun;
 
-	std::map<std::string,ConnectedUDPClient*>			m_clients;  // IPandPort = Key | Last packet received is value
+	SessionStateFile									m_stateFile;
+
+	std::map<int,GameRoom*>								m_rooms; // Session ID = Key
+	std::map<AddressKey,KnownSource>					m_sessionForAddress;
+	std::set<u_long>									m_relayAllowlist; // Network order
+	WorkerPool											m_workerPool;
+	int													m_numWorkerThreads;
+
+	double												m_lastRoomTickTimeSeconds;
 	double												m_durationSinceLastUserConnectedUpdate;
-	double												m_durationSinceLastPacketUpdate;
 
-	// Reliable Stuff
-	
-	// Guarentee Delivery
 	float												m_thresholdForPacketLossSimulation;
-	int													m_currentAckCount;
 
-private:
-
-	void convertIPAndPortToSingleString( char* ipAddress, int portNumber, std::string& out_combinedIPAndPort );
-	void updateOrCreateNewClient( const std::string& combinedIPAndPort, const sockaddr_in& clientAddress, const PlayerDataPacket& playerData );
-	void checkForExpiredClients();
-	void displayConnectedUsers();
+	// Handshake
+	HandshakeCookieGenerator							m_cookieGenerator;
+	unsigned int										m_numUnsolicitedPacketsDropped;
+	unsigned int										m_numInvalidCookiesDropped;
+
+	// Rate Limiting
+	RateLimitConfig										m_perClientRateLimit;
+	RateLimitConfig										m_perRelayRateLimit;
+	RateLimitConfig										m_perUnknownSourceRateLimit;
+	RateLimitConfig										m_allUnknownSourcesRateLimit;
+	UnknownSourceRateLimiter							m_unknownSourceRateLimiter;
+	RateLimitConfig										m_perSourceRoomCreationRateLimit;
+	RateLimitConfig										m_allRoomCreationRateLimit;
+	UnknownSourceRateLimiter							m_roomCreationRateLimiter; // Keyed by IP alone, the port is zeroed
+	unsigned int										m_numPacketsDroppedByUnknownSourceRateLimit;
+	unsigned int										m_numPacketsDroppedByClientRateLimit;
 
-	void sendPlayerDataToClients();
+private:
 
-	// Guarenteed Delivery
-	void checkForExpiredReliablePacketsWithNoAcks();
+	bool isKnownPacketID( unsigned char packetID ) const;
+	void dispatchRelayedPacket( const KnownSource& relaySource, const sockaddr_in& relayAddress, const RelayedPacket& relayedPacket, double receiveTimeSeconds );
+	void dispatchPacket( int sessionID, const sockaddr_in& clientAddress, const PlayerDataPacket& playerData, double receiveTimeSeconds );
+	void handlePacketFromUnknownSource( const sockaddr_in& clientAddress, const PlayerDataPacket& playerData, double receiveTimeSeconds );
+	void sendHandshakeChallenge( const sockaddr_in& clientAddress, int sessionID );
+	GameRoom* findOrCreateRoom( int sessionID, const sockaddr_in& clientAddress, double currentTimeSeconds );
+
+	void scheduleRoomTicks();
+	void retireRoom( GameRoom* room );
+	void rememberSource( AddressKey addressKey, int sessionID, bool isAllowedToRelay );
+	bool isAllowedRelayAddress( const sockaddr_in& address ) const;
+	void forgetDepartedClients();
+	void displayServerSummary();
+
+	void createStateFile();
+	void restoreRoomsFromStateFile();
+	bool checkForHandoverRequest();
+	bool completeHandover();
+	bool waitForHandoverState( LONG expectedState, double timeoutSeconds );
 };
 
 
-#endif
\ No newline at end of file
+#endif
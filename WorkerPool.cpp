@@ -0,0 +1,193 @@
+#include "WorkerPool.hpp"
+#include "AsyncLogger.hpp"
+
+#include <limits.h>
+
+
+WorkerPool::~WorkerPool() {
+
+	stop();
+}
+
+
+WorkerPool::WorkerPool() {
+
+	m_tasksAvailableSemaphore = nullptr;
+	m_shouldRun = 0;
+	m_nextWorkerToSchedule = 0;
+}
+
+
+int WorkerPool::getDefaultNumWorkers() {
+
+	SYSTEM_INFO systemInfo;
+	GetSystemInfo( &systemInfo );
+
+	// Leave a core for the thread reading the socket
+	int numWorkers = static_cast<int>( systemInfo.dwNumberOfProcessors ) - 1;
+	if ( numWorkers < 1 ) {
+
+		numWorkers = 1;
+	}
+
+	if ( numWorkers > MAX_WORKER_THREADS ) {
+
+		numWorkers = MAX_WORKER_THREADS;
+	}
+
+	return numWorkers;
+}
+
+
+void WorkerPool::start( int numWorkers ) {
+
+	if ( !m_workers.empty() ) {
+
+		return;
+	}
+
+	if ( numWorkers < 1 ) {
+
+		numWorkers = 1;
+	}
+
+	if ( numWorkers > MAX_WORKER_THREADS ) {
+
+		numWorkers = MAX_WORKER_THREADS;
+	}
+
+	m_tasksAvailableSemaphore = CreateSemaphore( nullptr, 0, LONG_MAX, nullptr );
+	m_shouldRun = 1;
+
+	// Every queue exists before any thread starts so stealing never sees a partial list
+	for ( int i = 0; i < numWorkers; ++i ) {
+
+		WorkerQueue* worker = new WorkerQueue;
+		worker->m_pool = this;
+		worker->m_workerIndex = i;
+		worker->m_thread = nullptr;
+		InitializeCriticalSection( &worker->m_lock );
+		m_workers.push_back( worker );
+	}
+
+	for ( int i = 0; i < numWorkers; ++i ) {
+
+		m_workers[i]->m_thread = CreateThread( nullptr, 0, &WorkerPool::workerThreadMain, m_workers[i], 0, nullptr );
+	}
+}
+
+
+void WorkerPool::stop() {
+
+	if ( m_workers.empty() ) {
+
+		return;
+	}
+
+	InterlockedExchange( &m_shouldRun, 0 );
+	ReleaseSemaphore( m_tasksAvailableSemaphore, static_cast<LONG>( m_workers.size() ), nullptr );
+
+	for ( int i = 0; i < static_cast<int>( m_workers.size() ); ++i ) {
+
+		WorkerQueue* worker = m_workers[i];
+		if ( worker->m_thread != nullptr ) {
+
+			WaitForSingleObject( worker->m_thread, INFINITE );
+			CloseHandle( worker->m_thread );
+		}
+	}
+
+	for ( int i = 0; i < static_cast<int>( m_workers.size() ); ++i ) {
+
+		DeleteCriticalSection( &m_workers[i]->m_lock );
+		delete m_workers[i];
+	}
+
+	m_workers.clear();
+	CloseHandle( m_tasksAvailableSemaphore );
+	m_tasksAvailableSemaphore = nullptr;
+}
+
+
+void WorkerPool::scheduleTask( WorkerTask* task ) {
+
+	if ( m_workers.empty() ) {
+
+		// Pool was never started, run inline
+		task->execute();
+		return;
+	}
+
+	unsigned long workerIndex = static_cast<unsigned long>( InterlockedIncrement( &m_nextWorkerToSchedule ) ) % m_workers.size();
+	WorkerQueue* worker = m_workers[ workerIndex ];
+
+	EnterCriticalSection( &worker->m_lock );
+	worker->m_tasks.push_back( task );
+	LeaveCriticalSection( &worker->m_lock );
+
+	// One release per task, so a woken worker is guaranteed something to pop or steal
+	ReleaseSemaphore( m_tasksAvailableSemaphore, 1, nullptr );
+}
+
+
+DWORD WINAPI WorkerPool::workerThreadMain( void* workerQueue ) {
+
+	WorkerQueue* worker = static_cast<WorkerQueue*>( workerQueue );
+	WorkerPool* pool = worker->m_pool;
+
+	while ( true ) {
+
+		WaitForSingleObject( pool->m_tasksAvailableSemaphore, INFINITE );
+
+		if ( pool->m_shouldRun == 0 ) {
+
+			break;
+		}
+
+		WorkerTask* task = pool->popOrStealTask( worker->m_workerIndex );
+		if ( task != nullptr ) {
+
+			task->execute();
+		}
+	}
+
+	// Frees the slot for whichever thread logs next, such as the workers of a restarted pool
+	AsyncLogger::releaseThreadRing();
+	return 0;
+}
+
+
+WorkerTask* WorkerPool::popOrStealTask( int workerIndex ) {
+
+	int numWorkers = static_cast<int>( m_workers.size() );
+
+	for ( int offset = 0; offset < numWorkers; ++offset ) {
+
+		WorkerQueue* queue = m_workers[ ( workerIndex + offset ) % numWorkers ];
+		WorkerTask* task = nullptr;
+
+		EnterCriticalSection( &queue->m_lock );
+		if ( !queue->m_tasks.empty() ) {
+
+			if ( offset == 0 ) {
+
+				// Own queue, newest first while it's still warm in cache
+				task = queue->m_tasks.back();
+				queue->m_tasks.pop_back();
+
+			} else {
+
+				task = queue->m_tasks.front();
+				queue->m_tasks.pop_front();
+			}
+		}
+		LeaveCriticalSection( &queue->m_lock );
+
+		if ( task != nullptr ) {
+
+			return task;
+		}
+	}
+
+	return nullptr;
+}
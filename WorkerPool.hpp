@@ -0,0 +1,62 @@
+#ifndef included_WorkerPool
+#define included_WorkerPool
+#pragma once
+
+#include <deque>
+#include <vector>
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "Ws2_32.lib")
+
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+const int MAX_WORKER_THREADS = 64;
+
+class WorkerTask {
+public:
+	virtual ~WorkerTask() {}
+
+	virtual void execute() = 0;
+};
+
+// Fixed set of threads, each with its own task deque. A worker pops from the
+// back of its own deque and, once that is empty, steals from the front of the
+// others, so one slow task doesn't leave the remaining cores idle.
+class WorkerPool {
+public:
+	~WorkerPool();
+	WorkerPool();
+
+	void start( int numWorkers );
+	void stop();
+
+	void scheduleTask( WorkerTask* task );
+
+	int getNumWorkers() const { return static_cast<int>( m_workers.size() ); }
+	static int getDefaultNumWorkers();
+
+protected:
+
+	struct WorkerQueue {
+		WorkerPool*										m_pool;
+		int												m_workerIndex;
+		HANDLE											m_thread;
+		CRITICAL_SECTION								m_lock;
+		std::deque<WorkerTask*>							m_tasks;
+	};
+
+	std::vector<WorkerQueue*>							m_workers;
+	HANDLE												m_tasksAvailableSemaphore;
+	volatile LONG										m_shouldRun;
+	volatile LONG										m_nextWorkerToSchedule;
+
+private:
+
+	static DWORD WINAPI workerThreadMain( void* workerQueue );
+	WorkerTask* popOrStealTask( int workerIndex );
+};
+
+#endif
@@ -0,0 +1,214 @@
+#include "WorldState.hpp"
+
+#include <string.h>
+#include <math.h>
+
+#include <emmintrin.h>
+
+namespace {
+
+	const double MINIMUM_SECONDS_FOR_VELOCITY_ESTIMATE = 0.001;
+	const float	 MINIMUM_SPEED_FOR_YAW = 0.01f;
+	const float	 RADIANS_TO_DEGREES = 57.2957795f;
+}
+
+
+WorldState::~WorldState() {
+
+}
+
+
+WorldState::WorldState() {
+
+	m_numPlayers = 0;
+
+	for ( int i = 0; i < MAX_PLAYERS_PER_ROOM; ++i ) {
+
+		clearSlot( i );
+	}
+}
+
+
+int WorldState::addPlayer( int playerID, float xPosition, float yPosition, double currentTimeSeconds ) {
+
+	if ( m_numPlayers >= MAX_PLAYERS_PER_ROOM ) {
+
+		return INVALID_WORLD_STATE_INDEX;
+	}
+
+	int index = m_numPlayers;
+	++m_numPlayers;
+
+	m_positionX[ index ] = xPosition;
+	m_positionY[ index ] = yPosition;
+	m_playerID[ index ] = static_cast<unsigned char>( playerID );
+	m_lastUpdateTimeSeconds[ index ] = currentTimeSeconds;
+	m_velocitySampleX[ index ] = xPosition;
+	m_velocitySampleY[ index ] = yPosition;
+	assignColorForPlayer( index, playerID );
+
+	return index;
+}
+
+
+int WorldState::removePlayer( int index ) {
+
+	if ( index < 0 || index >= m_numPlayers ) {
+
+		return INVALID_WORLD_STATE_INDEX;
+	}
+
+	int lastIndex = m_numPlayers - 1;
+	int movedIndex = INVALID_WORLD_STATE_INDEX;
+
+	if ( index != lastIndex ) {
+
+		m_positionX[ index ] = m_positionX[ lastIndex ];
+		m_positionY[ index ] = m_positionY[ lastIndex ];
+		m_velocityX[ index ] = m_velocityX[ lastIndex ];
+		m_velocityY[ index ] = m_velocityY[ lastIndex ];
+		m_yawDegrees[ index ] = m_yawDegrees[ lastIndex ];
+		m_red[ index ] = m_red[ lastIndex ];
+		m_green[ index ] = m_green[ lastIndex ];
+		m_blue[ index ] = m_blue[ lastIndex ];
+		m_playerID[ index ] = m_playerID[ lastIndex ];
+		m_lastUpdateTimeSeconds[ index ] = m_lastUpdateTimeSeconds[ lastIndex ];
+		m_velocitySampleX[ index ] = m_velocitySampleX[ lastIndex ];
+		m_velocitySampleY[ index ] = m_velocitySampleY[ lastIndex ];
+		movedIndex = lastIndex;
+	}
+
+	// Keep the tail zeroed so padded SIMD lanes stay harmless
+	clearSlot( lastIndex );
+	--m_numPlayers;
+
+	return movedIndex;
+}
+
+
+void WorldState::updatePlayerPosition( int index, float xPosition, float yPosition, double receiveTimeSeconds ) {
+
+	double secondsSinceLastUpdate = receiveTimeSeconds - m_lastUpdateTimeSeconds[ index ];
+
+	// Clients only send positions, so velocity and heading are estimated from updates at least a
+	// millisecond apart. Closer updates only move the player, the next estimate then spans from the
+	// last sample so distance and time always cover the same interval.
+	if ( secondsSinceLastUpdate > MINIMUM_SECONDS_FOR_VELOCITY_ESTIMATE ) {
+
+		float inverseSeconds = static_cast<float>( 1.0 / secondsSinceLastUpdate );
+		m_velocityX[ index ] = ( xPosition - m_velocitySampleX[ index ] ) * inverseSeconds;
+		m_velocityY[ index ] = ( yPosition - m_velocitySampleY[ index ] ) * inverseSeconds;
+		m_lastUpdateTimeSeconds[ index ] = receiveTimeSeconds;
+		m_velocitySampleX[ index ] = xPosition;
+		m_velocitySampleY[ index ] = yPosition;
+
+		float speedSquared = m_velocityX[ index ] * m_velocityX[ index ] + m_velocityY[ index ] * m_velocityY[ index ];
+		if ( speedSquared > MINIMUM_SPEED_FOR_YAW * MINIMUM_SPEED_FOR_YAW ) {
+
+			// 0 = east, + = counterclockwise, range 0-359
+			float yawDegrees = atan2f( m_velocityY[ index ], m_velocityX[ index ] ) * RADIANS_TO_DEGREES;
+			if ( yawDegrees < 0.0f ) {
+
+				yawDegrees += 360.0f;
+			}
+
+			m_yawDegrees[ index ] = yawDegrees;
+		}
+	}
+
+	m_positionX[ index ] = xPosition;
+	m_positionY[ index ] = yPosition;
+}
+
+
+void WorldState::zeroStaleVelocities( double currentTimeSeconds ) {
+
+	for ( int i = 0; i < m_numPlayers; ++i ) {
+
+		if ( currentTimeSeconds - m_lastUpdateTimeSeconds[i] > VELOCITY_TIMEOUT_SECONDS ) {
+
+			m_velocityX[i] = 0.0f;
+			m_velocityY[i] = 0.0f;
+		}
+	}
+}
+
+
+uint64_t WorldState::findPlayersWithinRadius( float xPosition, float yPosition, float radius ) const {
+
+	__m128 pointX = _mm_set1_ps( xPosition );
+	__m128 pointY = _mm_set1_ps( yPosition );
+	__m128 radiusSquared = _mm_set1_ps( radius * radius );
+
+	uint64_t playersWithinRadius = 0;
+	int numPlayersPadded = getNumPlayersRoundedToSimdWidth();
+
+	for ( int i = 0; i < numPlayersPadded; i += 4 ) {
+
+		__m128 deltaX = _mm_sub_ps( _mm_loadu_ps( &m_positionX[i] ), pointX );
+		__m128 deltaY = _mm_sub_ps( _mm_loadu_ps( &m_positionY[i] ), pointY );
+		__m128 distanceSquared = _mm_add_ps( _mm_mul_ps( deltaX, deltaX ), _mm_mul_ps( deltaY, deltaY ) );
+
+		uint64_t laneMask = static_cast<uint64_t>( _mm_movemask_ps( _mm_cmple_ps( distanceSquared, radiusSquared ) ) );
+		playersWithinRadius |= laneMask << i;
+	}
+
+	// Padded lanes sit at the origin and can pass the test, mask them off
+	if ( m_numPlayers < 64 ) {
+
+		playersWithinRadius &= ( static_cast<uint64_t>( 1 ) << m_numPlayers ) - 1;
+	}
+
+	return playersWithinRadius;
+}
+
+
+void WorldState::clearSlot( int index ) {
+
+	m_positionX[ index ] = 0.0f;
+	m_positionY[ index ] = 0.0f;
+	m_velocityX[ index ] = 0.0f;
+	m_velocityY[ index ] = 0.0f;
+	m_yawDegrees[ index ] = 0.0f;
+	m_red[ index ] = 0;
+	m_green[ index ] = 0;
+	m_blue[ index ] = 0;
+	m_playerID[ index ] = 0;
+	m_lastUpdateTimeSeconds[ index ] = 0.0;
+	m_velocitySampleX[ index ] = 0.0f;
+	m_velocitySampleY[ index ] = 0.0f;
+}
+
+
+// Temp hacky way to assign colors for players
+void WorldState::assignColorForPlayer( int index, int playerID ) {
+
+	m_red[ index ] = 250;
+	m_green[ index ] = 250;
+	m_blue[ index ] = 250;
+
+	if ( playerID == 1 ) {
+
+		m_red[ index ] = 250;
+		m_green[ index ] = 200;
+		m_blue[ index ] = 200;
+
+	} else if ( playerID == 2 ) {
+
+		m_red[ index ] = 220;
+		m_green[ index ] = 50;
+		m_blue[ index ] = 50;
+
+	} else if ( playerID == 3 ) {
+
+		m_red[ index ] = 50;
+		m_green[ index ] = 250;
+		m_blue[ index ] = 50;
+
+	} else if ( playerID == 4 ) {
+
+		m_red[ index ] = 50;
+		m_green[ index ] = 50;
+		m_blue[ index ] = 250;
+	}
+}
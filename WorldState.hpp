@@ -0,0 +1,61 @@
+#ifndef included_WorldState
+#define included_WorldState
+#pragma once
+
+#include <stdint.h>
+
+const int	MAX_PLAYERS_PER_ROOM = 64; // Multiple of eight so the widest SIMD loops ( 8 lane snapshots ) never need a tail
+const int	INVALID_WORLD_STATE_INDEX = -1;
+const double VELOCITY_TIMEOUT_SECONDS = 0.25; // Velocity is zeroed once a player has sent nothing for this long
+
+static_assert( MAX_PLAYERS_PER_ROOM % 8 == 0, "SIMD loops read whole groups of 8 players" );
+
+// Hot per player state for one room, stored as parallel arrays so the per
+// tick kernels stream through memory instead of chasing client pointers.
+// Slots [ 0, m_numPlayers ) are live, everything past that stays zeroed.
+class WorldState {
+public:
+	~WorldState();
+	WorldState();
+
+	int addPlayer( int playerID, float xPosition, float yPosition, double currentTimeSeconds );
+
+	// Swaps the last player into the hole, returns the slot that moved or INVALID_WORLD_STATE_INDEX
+	int removePlayer( int index );
+
+	// receiveTimeSeconds is when the packet came off the socket, not when the room got to it
+	void updatePlayerPosition( int index, float xPosition, float yPosition, double receiveTimeSeconds );
+
+	// Players that stopped sending stop moving in snapshots instead of drifting on their last estimate
+	void zeroStaleVelocities( double currentTimeSeconds );
+
+	// Bit i is set when player i is within radius of the point. One SIMD pass over every player.
+	uint64_t findPlayersWithinRadius( float xPosition, float yPosition, float radius ) const;
+
+	int getNumPlayers() const { return m_numPlayers; }
+	int getNumPlayersRoundedToSimdWidth() const { return ( m_numPlayers + 3 ) & ~3; }
+
+	float												m_positionX[ MAX_PLAYERS_PER_ROOM ];
+	float												m_positionY[ MAX_PLAYERS_PER_ROOM ];
+	float												m_velocityX[ MAX_PLAYERS_PER_ROOM ];
+	float												m_velocityY[ MAX_PLAYERS_PER_ROOM ];
+	float												m_yawDegrees[ MAX_PLAYERS_PER_ROOM ];
+	unsigned char										m_red[ MAX_PLAYERS_PER_ROOM ];
+	unsigned char										m_green[ MAX_PLAYERS_PER_ROOM ];
+	unsigned char										m_blue[ MAX_PLAYERS_PER_ROOM ];
+	unsigned char										m_playerID[ MAX_PLAYERS_PER_ROOM ];
+	double												m_lastUpdateTimeSeconds[ MAX_PLAYERS_PER_ROOM ]; // Only for velocity estimates
+	float												m_velocitySampleX[ MAX_PLAYERS_PER_ROOM ]; // Position at m_lastUpdateTimeSeconds
+	float												m_velocitySampleY[ MAX_PLAYERS_PER_ROOM ];
+
+protected:
+
+	int													m_numPlayers;
+
+private:
+
+	void clearSlot( int index );
+	void assignColorForPlayer( int index, int playerID );
+};
+
+#endif
@@ -5,6 +5,7 @@
 
 #include <string>
 #include <vector>
+#include <algorithm>
 
 #include <winsock2.h>
 #include <ws2tcpip.h>
@@ -15,16 +16,26 @@
 #include <windows.h>
 
 #include "UDPServer.hpp"
+#include "SnapshotRelay.hpp"
+#include "AsyncLogger.hpp"
 
 #include "../../CBEngine/EngineCode/TimeUtil.hpp"
 
 #define UNUSED( x ) (void)(x)
 
 const int MINIMUM_ARGUMENT_COUNT		= 4;
+const int SERVER_RATE_LIMIT_ARGUMENT_INDEX	= 4;
+const int RELAY_RATE_LIMIT_ARGUMENT_INDEX	= 6;
+const int NUM_RATE_LIMIT_CONFIGS		= 3;
+const int RELAY_ARGUMENT_COUNT			= 6;
 const std::string TYPE_SERVER_STRING	= "server";
+const std::string TYPE_RELAY_STRING		= "relay";
 const std::string TYPE_CLIENT_STRING	= "client";
 const std::string PROTOCOL_UDP_STRING	= "udp";
 const std::string PROTOCOL_TCP_STRING	= "tcp";
+const std::string DECODE_LOG_STRING		= "decode";
+const std::string BINARY_LOG_FILE_PATH	= "FeedbackServer.binlog";
+const std::string HANDOVER_STRING		= "handover";
 
 typedef enum {
 
@@ -32,6 +43,7 @@ typedef enum {
 	TYPE_CLIENT_TCP,
 	TYPE_SERVER_UDP,
 	TYPE_SERVER_TCP,
+	TYPE_RELAY_UDP,
 	TYPE_UNNKOWN,
 
 } NetworkType;
@@ -53,7 +65,11 @@ void parseCommandLineArgs( int numberOfArgs, char** arguments, std::vector<std::
 
 /*
 	Expected Format Command Line Args Order:
-	Server/Client  UDP/TCP  IP  PORT
+	Server/Client  UDP/TCP  IP  PORT  [RateLimits]  [handover]
+	Relay  UDP  IP  PORT  UpstreamIP  UpstreamPort  [RateLimits]
+
+	RateLimits are up to three packets per second and burst size pairs, in the order
+	per client, per unknown source, all unknown sources. Pairs left off keep their defaults.
 */
 NetworkType initializeBasedOnReceivedArguments( const std::vector<std::string>& commandLineTokens, std::string& out_IPAddress, std::string& out_PortNumber ) {
 
@@ -66,6 +82,7 @@ NetworkType initializeBasedOnReceivedArguments( const std::vector<std::string>&
 
 	const std::string& clientOrServerToken = commandLineTokens[0];
 	bool isClient = false;
+	bool isRelay = false;
 
 	if ( clientOrServerToken == TYPE_SERVER_STRING ) {
 
@@ -74,6 +91,10 @@ NetworkType initializeBasedOnReceivedArguments( const std::vector<std::string>&
 	} else if ( clientOrServerToken == TYPE_CLIENT_STRING ) {
 
 		isClient = true;
+
+	} else if ( clientOrServerToken == TYPE_RELAY_STRING ) {
+
+		isRelay = true;
 	}
 
 	const std::string UDPOrTCPToken = commandLineTokens[1];
@@ -88,7 +109,12 @@ NetworkType initializeBasedOnReceivedArguments( const std::vector<std::string>&
 		isUDP = false;
 	}
 
-	if ( isClient && isUDP ) {
+	if ( isRelay && isUDP ) {
+
+		typeBasedOnArgs = TYPE_RELAY_UDP;
+		printf( "UDP Relay Requested\n" );
+
+	} else if ( isClient && isUDP ) {
 
 		typeBasedOnArgs = TYPE_CLIENT_UDP;
 		printf( "UDP Client Requested\n" );
@@ -115,6 +141,46 @@ NetworkType initializeBasedOnReceivedArguments( const std::vector<std::string>&
 	return typeBasedOnArgs;
 }
 
+bool isHandoverRequested( const std::vector<std::string>& commandLineTokens ) {
+
+	return commandLineTokens.size() > MINIMUM_ARGUMENT_COUNT && commandLineTokens.back() == HANDOVER_STRING;
+}
+
+bool parseRateLimitArguments( const std::vector<std::string>& commandLineTokens, int firstArgumentIndex, RateLimitConfig* out_rateLimits ) {
+
+	out_rateLimits[0] = RateLimitConfig( DEFAULT_CLIENT_PACKETS_PER_SECOND, DEFAULT_CLIENT_BURST_SIZE );
+	out_rateLimits[1] = RateLimitConfig( DEFAULT_UNKNOWN_SOURCE_PACKETS_PER_SECOND, DEFAULT_UNKNOWN_SOURCE_BURST_SIZE );
+	out_rateLimits[2] = RateLimitConfig( DEFAULT_ALL_UNKNOWN_SOURCES_PACKETS_PER_SECOND, DEFAULT_ALL_UNKNOWN_SOURCES_BURST_SIZE );
+
+	int numArguments = static_cast<int>( commandLineTokens.size() ) - firstArgumentIndex;
+	if ( isHandoverRequested( commandLineTokens ) ) {
+
+		--numArguments;
+	}
+
+	if ( numArguments <= 0 ) {
+
+		return false;
+	}
+
+	int numConfigsGiven = std::min<int>( numArguments / 2, NUM_RATE_LIMIT_CONFIGS );
+	for ( int i = 0; i < numConfigsGiven; ++i ) {
+
+		float packetsPerSecond = static_cast<float>( atof( commandLineTokens[ firstArgumentIndex + ( i * 2 ) ].c_str() ) );
+		float burstSize = static_cast<float>( atof( commandLineTokens[ firstArgumentIndex + ( i * 2 ) + 1 ].c_str() ) );
+
+		if ( packetsPerSecond <= 0.0f || burstSize < 1.0f ) {
+
+			printf( "Ignoring invalid rate limit arguments, using defaults\n" );
+			return false;
+		}
+
+		out_rateLimits[i] = RateLimitConfig( packetsPerSecond, burstSize );
+	}
+
+	return numConfigsGiven > 0;
+}
+
 int main( int argc, char** argv ) {
 
 	cbutil::initializeTimeSystem();
@@ -122,14 +188,80 @@ int main( int argc, char** argv ) {
 	std::vector<std::string> commandLineTokens;
 	parseCommandLineArgs( argc, argv, commandLineTokens );
 
+	// Offline decoding of a binary log: decode <path>
+	if ( commandLineTokens.size() >= 2 && commandLineTokens[0] == DECODE_LOG_STRING ) {
+
+		bool decoded = AsyncLogger::decodeBinaryLogFile( commandLineTokens[1], stdout );
+		return decoded ? 0 : 1;
+	}
+
 	NetworkType networkAppType = TYPE_UNNKOWN;
 	std::string IPAddressReq;
 	std::string PortNumberReq;
 	networkAppType = initializeBasedOnReceivedArguments( commandLineTokens, IPAddressReq, PortNumberReq );
 
-	UDPServer udpProtocolServer( IPAddressReq, PortNumberReq );
-	udpProtocolServer.initialize();
-	udpProtocolServer.run();
+	bool handoverRequested = isHandoverRequested( commandLineTokens );
+
+	// The process being replaced is still writing the default log, and relays run several to a machine
+	std::string binaryLogFilePath = BINARY_LOG_FILE_PATH;
+	if ( handoverRequested || networkAppType == TYPE_RELAY_UDP ) {
+
+		char processIDAsCString[32];
+		sprintf_s( processIDAsCString, sizeof( processIDAsCString ), ".%lu", GetCurrentProcessId() );
+		binaryLogFilePath.insert( binaryLogFilePath.rfind( '.' ), processIDAsCString );
+	}
+
+	AsyncLogger::initialize( binaryLogFilePath );
+
+	if ( networkAppType == TYPE_RELAY_UDP ) {
+
+		if ( commandLineTokens.size() < RELAY_ARGUMENT_COUNT ) {
+
+			printf( "A relay needs the upstream IP and port after its own\n" );
+
+		} else {
+
+			SnapshotRelay udpRelay( IPAddressReq, PortNumberReq, commandLineTokens[4], commandLineTokens[5] );
+
+			RateLimitConfig rateLimits[ NUM_RATE_LIMIT_CONFIGS ];
+			if ( parseRateLimitArguments( commandLineTokens, RELAY_RATE_LIMIT_ARGUMENT_INDEX, rateLimits ) ) {
+
+				udpRelay.setRateLimits( rateLimits[0], rateLimits[1], rateLimits[2] );
+			}
+
+			udpRelay.initialize();
+			udpRelay.run();
+		}
+
+	} else {
+
+		UDPServer udpProtocolServer( IPAddressReq, PortNumberReq );
+
+		RateLimitConfig rateLimits[ NUM_RATE_LIMIT_CONFIGS ];
+		if ( parseRateLimitArguments( commandLineTokens, SERVER_RATE_LIMIT_ARGUMENT_INDEX, rateLimits ) ) {
+
+			udpProtocolServer.setRateLimits( rateLimits[0], rateLimits[1], rateLimits[2] );
+		}
+
+		HandoverResult handoverResult = HANDOVER_RESULT_NO_SERVER_RUNNING;
+		if ( handoverRequested ) {
+
+			handoverResult = udpProtocolServer.initializeFromHandover();
+		}
+
+		if ( handoverResult == HANDOVER_RESULT_NO_SERVER_RUNNING ) {
+
+			udpProtocolServer.initialize();
+		}
+
+		// Binding or creating the state file now would fight the server that is still running
+		if ( handoverResult != HANDOVER_RESULT_ABANDONED ) {
+
+			udpProtocolServer.run();
+		}
+	}
+
+	AsyncLogger::shutdown();
 	
 	printf( "Program Concluding..." );
 